@@ -1,29 +1,36 @@
 #include "actor.h"
+#include "symbol.h"
 #include <iostream>
 #include "stopwatch.h"
 #include <stdio.h>
 #include <string>
 #include <inttypes.h>
+#ifdef _MSC_VER
+#include <crtdbg.h>
+#endif
 
-class Hello : public Actor<> {
+class Hello : public Actor<Symbol, Symbol> {
 public:
 	Hello() : cnt(0), lastTime(0){}
-	void onMessage(const std::string& sourceName, const std::string& messageName, const std::string& msg) override {
+	void onMessage(const Symbol& sourceName, const Symbol& messageName, const std::string& msg) override {
 		if (messageName == "perf") {
 			auto time = w.ElapsedMilliseconds();
 			if (time != 0) {
-				printf("%s: qps %.2f lastTime: %llu\n", id().c_str(), float(cnt * 1000) / time, lastTime);
+				printf("%s: qps %.2f lastTime: %llu\n", id().name().c_str(), float(cnt * 1000) / time, lastTime);
 			} else {
-				printf("%s: msgCnt: %" PRId64 ", time: %" PRId64 "\n", id().c_str(), cnt.load(), time);
+				printf("%s: msgCnt: %" PRId64 ", time: %" PRId64 "\n", id().name().c_str(), cnt.load(), time);
 			}
+			printf("%s: onMessage %s\n", id().name().c_str(), w.LapSummary().c_str());
 			return;
 		}
+		w.SkipLap();
 		sendMessage(messageName, messageName, NULL);
 		if (!w.IsRunning()) {
 			w.Start();
 		}
 		lastTime = time(NULL);
 		++cnt;
+		w.Lap();
 	}
 private:
 	std::atomic<uint64_t> cnt;
@@ -31,25 +38,27 @@ private:
 	time_t lastTime;
 };
 
-class World : public Actor<> {
+class World : public Actor<Symbol, Symbol> {
 public:
 	World() {}
-	void onMessage(const std::string& sourceName, const std::string& messageName, const std::string& msg) override {
-		sendMessage(sourceName, messageName, NULL);
+	void onMessage(const Symbol& sourceName, const Symbol& messageName, const std::string& msg) override {
+		reply(NULL);
 	}
 };
 
 int main() {
+#ifdef _MSC_VER
 	_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG | _CRTDBG_LEAK_CHECK_DF);
-	ActorManager<> inst;
-	inst.registerActor("Hello1", new Hello);
-	inst.registerActor("Hello2", new Hello);
-	inst.registerActor("Hello3", new Hello);
-	inst.registerActor("Hello4", new Hello);
-	inst.registerActor("World1", new World);
-	inst.registerActor("World2", new World);
-	inst.registerActor("World3", new World);
-	inst.registerActor("World4", new World);
+#endif
+	ActorManager<Symbol, Symbol> inst;
+	inst.registerActor(ACTOR_SYMBOL("Hello1"), new Hello);
+	inst.registerActor(ACTOR_SYMBOL("Hello2"), new Hello);
+	inst.registerActor(ACTOR_SYMBOL("Hello3"), new Hello);
+	inst.registerActor(ACTOR_SYMBOL("Hello4"), new Hello);
+	inst.registerActor(ACTOR_SYMBOL("World1"), new World);
+	inst.registerActor(ACTOR_SYMBOL("World2"), new World);
+	inst.registerActor(ACTOR_SYMBOL("World3"), new World);
+	inst.registerActor(ACTOR_SYMBOL("World4"), new World);
 	while(true) {
 		std::string cmd;
 		std::cin >> cmd;
@@ -59,11 +68,37 @@ int main() {
 			std::string src, dst;
 			std::cin >> src >> dst;
 			inst.sendMessage("Console", src, dst, NULL);
+		} else if (cmd == "ask") {
+			std::string dst;
+			std::cin >> dst;
+			auto future = inst.ask("Console", dst, "ping", NULL, std::chrono::milliseconds(1000));
+			std::unique_ptr<std::string> reply;
+			SEND_MESSAGE_RESULT ret = future.get(reply);
+			printf("%s: %s\n", dst.c_str(), ret == E_SMR_OK ? "replied" : ret == E_SMR_TIMEOUT ? "timeout" : "failed");
 		} else if (cmd == "perf") {
-			inst.sendMessage("Console", "Hello1", "perf", NULL);
-			inst.sendMessage("Console", "Hello2", "perf", NULL);
-			inst.sendMessage("Console", "Hello3", "perf", NULL);
-			inst.sendMessage("Console", "Hello4", "perf", NULL);
+			inst.sendMessage("Console", "Hello1", "perf", NULL, E_MP_SYSTEM);
+			inst.sendMessage("Console", "Hello2", "perf", NULL, E_MP_SYSTEM);
+			inst.sendMessage("Console", "Hello3", "perf", NULL, E_MP_SYSTEM);
+			inst.sendMessage("Console", "Hello4", "perf", NULL, E_MP_SYSTEM);
+		} else if (cmd == "stats") {
+			auto all = inst.stats();
+			for (auto it = all.begin(); it != all.end(); ++it) {
+				const ActorStats& s = it->second;
+				printf("%s: in %" PRIu64 " out %" PRIu64 " depth %u high %u queue p50/p99 %" PRIu64 "/%" PRIu64 "ns handler p50/p99 %" PRIu64 "/%" PRIu64 "ns\n",
+					it->first.name().c_str(), s.enqueued, s.dequeued, unsigned(s.depth), unsigned(s.highWater),
+					s.queueDelay.percentile(0.5), s.queueDelay.percentile(0.99), s.handlerTime.percentile(0.5), s.handlerTime.percentile(0.99));
+			}
+		} else if (cmd == "trace") {
+			//trace on | trace off | trace <file.json>
+			std::string arg;
+			std::cin >> arg;
+			if (arg == "on") {
+				message_tracer::global().start(100);
+			} else if (arg == "off") {
+				message_tracer::global().stop();
+			} else {
+				printf("%s: %s\n", arg.c_str(), message_tracer::global().exportChromeTrace(arg) ? "written" : "failed");
+			}
 		} else if (cmd == "del") {
 			std::cin >> cmd;
 			inst.releaseActor(cmd);
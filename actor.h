@@ -4,7 +4,13 @@
 #include <map>
 #include <mutex>
 #include "shared_mutex.h"
-#include "mq.h"
+#include "mailbox.h"
+#include "scheduler.h"
+#include "slot_registry.h"
+#include "timer_wheel.h"
+#include "ask.h"
+#include "actor_metrics.h"
+#include "trace.h"
 #include <sstream>
 #include <thread>
 #include <threadgroup.h>
@@ -17,7 +23,7 @@ template<typename ActorIdType = std::string, typename MessageIdType = std::strin
 class ActorManager;
 
 template<typename ActorIdType, typename messageType>
-class ActorImplBase
+class ActorImplBase : public std::enable_shared_from_this<ActorImplBase<ActorIdType, messageType>>
 {
 public:
 	virtual ~ActorImplBase() {}
@@ -28,6 +34,111 @@ public:
 	virtual void Poll() {}
 	virtual const ActorIdType& id() const = 0;
 	virtual SEND_MESSAGE_RESULT enqueue(std::unique_ptr<messageType> msg) = 0;
+	virtual SEND_MESSAGE_RESULT enqueue(std::vector<std::unique_ptr<messageType>>& msgs) = 0;
+	virtual MailboxStats mailboxStats() = 0;
+	virtual ActorStats stats() = 0;
+};
+
+namespace detail {
+	//shared by the registry entry and every ActorRef, revoked by releaseActor.
+	template<typename ActorIdType, typename Holder>
+	struct ActorCell : public noncopyable {
+		ActorCell(const ActorIdType& id_, Holder* target_, bool unguarded_) : id(id_), target(target_), unguarded(unguarded_) {}
+		ActorIdType id;
+		std::atomic<Holder*> target;
+		//enqueue outside the read section, see ActorManager::post.
+		bool unguarded;
+	};
+}
+
+//messages handed to onMessageBatch, batch[i].src / batch[i].id / *batch[i].msg.
+template<typename ActorIdType = std::string, typename MessageIdType = std::string, typename MessageType = std::string>
+class MessageSpan
+{
+public:
+	typedef detail::Message<ActorIdType, MessageIdType, MessageType> value_type;
+	MessageSpan(std::unique_ptr<value_type>* data, size_t size) : m_data(data), m_size(size) {}
+	size_t size() const {
+		return m_size;
+	}
+	bool empty() const {
+		return m_size == 0;
+	}
+	const value_type& operator[](size_t i) const {
+		return *m_data[i];
+	}
+	//keep batch[i] past the handler, batch[i] must not be used afterwards.
+	std::unique_ptr<value_type> take(size_t i) const {
+		return std::move(m_data[i]);
+	}
+private:
+	std::unique_ptr<value_type>* m_data;
+	size_t m_size;
+};
+
+//resolved handle to an actor, sending through it skips the name lookup.
+//after releaseActor it returns E_SMR_NOTFOUND, it never keeps the actor alive between sends.
+template<typename ActorIdType = std::string, typename MessageIdType = std::string, typename MessageType = std::string>
+class ActorRef
+{
+	typedef detail::Message<ActorIdType, MessageIdType, MessageType> messageType;
+	typedef ActorImplBase<ActorIdType, messageType> ActorHolder;
+public:
+	ActorRef() {}
+	bool valid() const {
+		return m_cell && m_cell->target.load(std::memory_order_acquire) != nullptr;
+	}
+	const ActorIdType& id() const {
+		return m_cell->id;
+	}
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& sourceName, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_cell) {
+			delete msg;
+			return E_SMR_NOTFOUND;
+		}
+		return send(std::unique_ptr<messageType>(new messageType(sourceName, messageName, msg, priority)));
+	}
+	//msg is moved into the envelope, see detail::payload.
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& sourceName, const MessageIdType& messageName, MessageType&& msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_cell) {
+			return E_SMR_NOTFOUND;
+		}
+		return send(std::unique_ptr<messageType>(new messageType(detail::emplace_tag(), sourceName, messageName, priority, std::move(msg))));
+	}
+	//the payload is constructed from args inside the envelope, normal priority.
+	template<typename ...Args>
+	SEND_MESSAGE_RESULT emplaceMessage(const ActorIdType& sourceName, const MessageIdType& messageName, Args&&... args) const
+	{
+		if (!m_cell) {
+			return E_SMR_NOTFOUND;
+		}
+		return send(std::unique_ptr<messageType>(new messageType(detail::emplace_tag(), sourceName, messageName, E_MP_NORMAL, std::forward<Args>(args)...)));
+	}
+private:
+	friend class ActorManager<ActorIdType, MessageIdType, MessageType>;
+	SEND_MESSAGE_RESULT send(std::unique_ptr<messageType> envelope) const
+	{
+		//releaseActor waits for us before the target is destroyed.
+		std::shared_ptr<ActorHolder> holder;
+		{
+			rcu_read_guard guard;
+			ActorHolder* target = m_cell->target.load(std::memory_order_acquire);
+			if (target && !m_cell->unguarded) {
+				return target->enqueue(std::move(envelope));
+			}
+			if (target) {
+				holder = target->shared_from_this();
+			}
+		}
+		if (holder) {
+			return holder->enqueue(std::move(envelope));
+		}
+		return E_SMR_NOTFOUND;
+	}
+	explicit ActorRef(const std::shared_ptr<detail::ActorCell<ActorIdType, ActorHolder>>& cell) : m_cell(cell) {}
+	std::shared_ptr<detail::ActorCell<ActorIdType, ActorHolder>> m_cell;
 };
 
 template<typename ActorIdType = std::string, typename MessageIdType = std::string, typename MessageType = std::string>
@@ -40,14 +151,85 @@ template<typename ActorIdType = std::string, typename MessageIdType = std::strin
 class Actor
 {
 public:
+	Actor() : m_impl(nullptr), m_current(nullptr) {}
 	virtual ~Actor() {}
-	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg) const
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
 	{
 		if (!m_impl) {
 			delete msg;
 			return E_SMR_NOTREGISTER;
 		}
-		return m_impl->sendMessage(targetName, messageName, msg);
+		return m_impl->sendMessage(targetName, messageName, msg, priority);
+	}
+	SEND_MESSAGE_RESULT sendMessage(const ActorRef<ActorIdType, MessageIdType, MessageType>& target, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_impl) {
+			delete msg;
+			return E_SMR_NOTREGISTER;
+		}
+		return target.sendMessage(m_id, messageName, msg, priority);
+	}
+	//msg is moved into the envelope, a small one is stored inline and costs no allocation
+	//of its own, see detail::payload.
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType&& msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_impl) {
+			return E_SMR_NOTREGISTER;
+		}
+		return m_impl->emplaceMessage(targetName, messageName, priority, std::move(msg));
+	}
+	SEND_MESSAGE_RESULT sendMessage(const ActorRef<ActorIdType, MessageIdType, MessageType>& target, const MessageIdType& messageName, MessageType&& msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_impl) {
+			return E_SMR_NOTREGISTER;
+		}
+		return target.sendMessage(m_id, messageName, std::move(msg), priority);
+	}
+	//the payload is constructed from args inside the envelope, normal priority:
+	//	emplaceMessage("db", "put", key, value);
+	template<typename ...Args>
+	SEND_MESSAGE_RESULT emplaceMessage(const ActorIdType& targetName, const MessageIdType& messageName, Args&&... args) const
+	{
+		if (!m_impl) {
+			return E_SMR_NOTREGISTER;
+		}
+		return m_impl->emplaceMessage(targetName, messageName, E_MP_NORMAL, std::forward<Args>(args)...);
+	}
+	template<typename ...Args>
+	SEND_MESSAGE_RESULT emplaceMessage(const ActorRef<ActorIdType, MessageIdType, MessageType>& target, const MessageIdType& messageName, Args&&... args) const
+	{
+		if (!m_impl) {
+			return E_SMR_NOTREGISTER;
+		}
+		return target.emplaceMessage(m_id, messageName, std::forward<Args>(args)...);
+	}
+	//the reply comes back through the future, see ActorManager::ask. Do not block on it here.
+	AskFuture<MessageType> ask(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero(), MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_impl) {
+			delete msg;
+			return AskFuture<MessageType>(E_SMR_NOTREGISTER);
+		}
+		return m_impl->manager()->ask(m_id, targetName, messageName, msg, timeout, priority);
+	}
+	//answer the message onMessage is handling: completes the sender's ask, or for a plain
+	//sendMessage sends msg back to the source under the same message id.
+	SEND_MESSAGE_RESULT reply(MessageType* msg) const
+	{
+		if (!m_current) {
+			delete msg;
+			return E_SMR_NOTFOUND;
+		}
+		return reply(*m_current, msg);
+	}
+	//for onMessageBatch, answer batch[i].
+	SEND_MESSAGE_RESULT reply(const typename MessageSpan<ActorIdType, MessageIdType, MessageType>::value_type& request, MessageType* msg) const
+	{
+		if (!m_impl) {
+			delete msg;
+			return E_SMR_NOTREGISTER;
+		}
+		return m_impl->manager()->reply(m_id, request, msg);
 	}
 	//implement one of below
 	//onEnter will never failed.
@@ -59,6 +241,14 @@ public:
 	}
 	virtual void onExit() {}
 	virtual void onMessage(const ActorIdType& sourceName, const MessageIdType& messageName, const MessageType& msg) = 0;
+	//override to handle whatever is pending in one go, at most MailboxOptions::batch messages.
+	virtual void onMessageBatch(const MessageSpan<ActorIdType, MessageIdType, MessageType>& batch) {
+		for (size_t i = 0; i < batch.size(); i++) {
+			m_current = &batch[i];
+			onMessage(batch[i].src, batch[i].id, *(batch[i].msg));
+		}
+		m_current = nullptr;
+	}
 	const ActorIdType& id() const {
 		return m_id;
 	}
@@ -67,20 +257,93 @@ private:
 	friend class ActorImpl<ActorIdType, MessageIdType, MessageType>;
 	ActorImpl<ActorIdType, MessageIdType, MessageType>* m_impl;
 	ActorIdType m_id;
+	//what reply() answers, only set inside the default onMessageBatch.
+	const typename MessageSpan<ActorIdType, MessageIdType, MessageType>::value_type* m_current;
 };
 
 template<typename ActorIdType = std::string, typename MessageIdType = std::string, typename MessageType = std::string>
 class ActorNoThread
 {
 public:
+	ActorNoThread() : m_impl(nullptr), m_current(nullptr) {}
 	virtual ~ActorNoThread() {}
-	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg) const
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_impl) {
+			delete msg;
+			return E_SMR_NOTREGISTER;
+		}
+		return m_impl->sendMessage(targetName, messageName, msg, priority);
+	}
+	SEND_MESSAGE_RESULT sendMessage(const ActorRef<ActorIdType, MessageIdType, MessageType>& target, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_impl) {
+			delete msg;
+			return E_SMR_NOTREGISTER;
+		}
+		return target.sendMessage(m_id, messageName, msg, priority);
+	}
+	//msg is moved into the envelope, a small one is stored inline and costs no allocation
+	//of its own, see detail::payload.
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType&& msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_impl) {
+			return E_SMR_NOTREGISTER;
+		}
+		return m_impl->emplaceMessage(targetName, messageName, priority, std::move(msg));
+	}
+	SEND_MESSAGE_RESULT sendMessage(const ActorRef<ActorIdType, MessageIdType, MessageType>& target, const MessageIdType& messageName, MessageType&& msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_impl) {
+			return E_SMR_NOTREGISTER;
+		}
+		return target.sendMessage(m_id, messageName, std::move(msg), priority);
+	}
+	//the payload is constructed from args inside the envelope, normal priority:
+	//	emplaceMessage("db", "put", key, value);
+	template<typename ...Args>
+	SEND_MESSAGE_RESULT emplaceMessage(const ActorIdType& targetName, const MessageIdType& messageName, Args&&... args) const
+	{
+		if (!m_impl) {
+			return E_SMR_NOTREGISTER;
+		}
+		return m_impl->emplaceMessage(targetName, messageName, E_MP_NORMAL, std::forward<Args>(args)...);
+	}
+	template<typename ...Args>
+	SEND_MESSAGE_RESULT emplaceMessage(const ActorRef<ActorIdType, MessageIdType, MessageType>& target, const MessageIdType& messageName, Args&&... args) const
+	{
+		if (!m_impl) {
+			return E_SMR_NOTREGISTER;
+		}
+		return target.emplaceMessage(m_id, messageName, std::forward<Args>(args)...);
+	}
+	//the reply comes back through the future, see ActorManager::ask. Do not block on it here.
+	AskFuture<MessageType> ask(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero(), MESSAGE_PRIORITY priority = E_MP_NORMAL) const
+	{
+		if (!m_impl) {
+			delete msg;
+			return AskFuture<MessageType>(E_SMR_NOTREGISTER);
+		}
+		return m_impl->manager()->ask(m_id, targetName, messageName, msg, timeout, priority);
+	}
+	//answer the message onMessage is handling: completes the sender's ask, or for a plain
+	//sendMessage sends msg back to the source under the same message id.
+	SEND_MESSAGE_RESULT reply(MessageType* msg) const
+	{
+		if (!m_current) {
+			delete msg;
+			return E_SMR_NOTFOUND;
+		}
+		return reply(*m_current, msg);
+	}
+	//for onMessageBatch, answer batch[i].
+	SEND_MESSAGE_RESULT reply(const typename MessageSpan<ActorIdType, MessageIdType, MessageType>::value_type& request, MessageType* msg) const
 	{
 		if (!m_impl) {
 			delete msg;
 			return E_SMR_NOTREGISTER;
 		}
-		return m_impl->sendMessage(targetName, messageName, msg);
+		return m_impl->manager()->reply(m_id, request, msg);
 	}
 	//implement one of below
 	//onEnter will never failed.
@@ -92,34 +355,54 @@ public:
 	}
 	virtual void onExit() {}
 	virtual void onMessage(const ActorIdType& sourceName, const MessageIdType& messageName, const MessageType& msg) = 0;
+	//override to handle whatever is pending in one go, at most MailboxOptions::batch messages.
+	virtual void onMessageBatch(const MessageSpan<ActorIdType, MessageIdType, MessageType>& batch) {
+		for (size_t i = 0; i < batch.size(); i++) {
+			m_current = &batch[i];
+			onMessage(batch[i].src, batch[i].id, *(batch[i].msg));
+		}
+		m_current = nullptr;
+	}
 	const ActorIdType& id() const {
 		return m_id;
 	}
 	ActorManager<ActorIdType, MessageIdType, MessageType>* manager();
+protected:
+	//runs on the pool after wake(), before the pending messages.
+	virtual void onWake() {}
+	//have onWake() called soon, from any thread. Hold lifetime() across threads.
+	void wake();
+	//locks while the actor is registered and keeps it alive meanwhile.
+	std::weak_ptr<void> lifetime() const;
 private:
 	friend class ActorImplNoThread<ActorIdType, MessageIdType, MessageType>;
 	ActorImplNoThread<ActorIdType, MessageIdType, MessageType>* m_impl;
 	ActorIdType m_id;
+	//what reply() answers, only set inside the default onMessageBatch.
+	const typename MessageSpan<ActorIdType, MessageIdType, MessageType>::value_type* m_current;
 };
 
 template<typename ActorIdType, typename MessageIdType, typename MessageType>
 class ActorImpl : public ActorImplBase<ActorIdType, detail::Message<ActorIdType, MessageIdType, MessageType>> {
 public:
 	typedef typename detail::Message<ActorIdType, MessageIdType, MessageType> messageType;
-	ActorImpl(const ActorIdType& id, ActorManager<ActorIdType, MessageIdType, MessageType>& mgr, Actor<ActorIdType, MessageIdType, MessageType>* actor, bool own, size_t messageQueueOverhead)
-		: m_own(own), m_exitFlag(false), m_initDone(false), m_initSucc(false), m_actor(actor), m_mgr(mgr), m_messageQueue(messageQueueOverhead) {
+	ActorImpl(const ActorIdType& id, ActorManager<ActorIdType, MessageIdType, MessageType>& mgr, Actor<ActorIdType, MessageIdType, MessageType>* actor, bool own, const MailboxOptions& options)
+		: m_own(own), m_exitFlag(false), m_initDone(false), m_initSucc(false), m_batchSize(options.batch), m_wait(options.wait), m_actor(actor), m_mgr(mgr), m_messageQueue(make_mailbox<messageType>(options)) {
 		actor->m_impl = this;
 		actor->m_id = id;
+		m_messageQueue->onDrop([&mgr](messageType& msg) {
+			mgr.dropped(msg);
+		});
 	}
 	virtual ~ActorImpl() {
 		m_exitFlag = true;
-		m_messageQueue.close();
+		m_messageQueue->close();
 		if (m_thread.joinable()) {
 			m_thread.join();
 		}
-		std::unique_ptr<messageType> msg;
-		while (m_messageQueue.try_pop(msg)) {
-			m_actor->onMessage(msg->src, msg->id, *(msg->msg));
+		std::vector<std::unique_ptr<messageType>> batch;
+		while (m_messageQueue->try_pop(batch, m_batchSize)) {
+			dispatch(batch);
 		}
 #ifdef LOG4CPP_CATEGORY_NAME
 		std::ostringstream ss;
@@ -151,7 +434,9 @@ public:
 			}
 #endif
 #endif
-			std::unique_ptr<messageType> msg;
+			message_tracer::nameThread("actor:" + detail::trace_name(m_actor->m_id, m_traceTag.serial()));
+			std::vector<std::unique_ptr<messageType>> batch;
+			batch.reserve(m_batchSize);
 #ifdef LOG4CPP_CATEGORY_NAME
 			std::ostringstream ss;
 			ss << "actor:" << m_actor->m_id;
@@ -160,6 +445,7 @@ public:
 #endif
 			m_initSucc = m_actor->onEnterMayFailed();
 			m_initDone = true;
+			m_initEvent.notifyAll();
 #ifdef LOG4CPP_CATEGORY_NAME
 			log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("Actor[%s] onEnter exit [%s].", name.c_str(), m_initSucc ? "true" : "false");
 #endif
@@ -168,46 +454,97 @@ public:
 				return;
 			}
 			while(!m_exitFlag) {
-				if (!m_messageQueue.pop(msg)) {
+				//everything pending up to m_batchSize comes out in one go.
+				if (!m_messageQueue->pop(batch, m_batchSize)) {
 					continue;
 				}
-				m_actor->onMessage(msg->src, msg->id, *(msg->msg));
-				msg.reset();
+				dispatch(batch);
 			}
 		});
-		while(!m_initDone) {
-			std::this_thread::yield();
-		}
+		m_wait.waitUntil(m_initEvent, [this]() { return m_initDone.load(); });
 		return m_initSucc;
 	}
 	const ActorIdType& id() const override {
 		return m_actor->id();
 	}
-	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg) {
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority) {
 		if (targetName == m_actor->id())
 		{
-			return enqueue(std::unique_ptr<messageType>(new messageType(targetName, messageName, msg)));
+			return enqueue(std::unique_ptr<messageType>(new messageType(targetName, messageName, msg, priority)));
 		}
 		else
 		{
-			return m_mgr.sendMessage(m_actor->id(), targetName, messageName, msg);
+			return m_mgr.sendMessage(m_actor->id(), targetName, messageName, msg, priority);
+		}
+	}
+	template<typename ...Args>
+	SEND_MESSAGE_RESULT emplaceMessage(const ActorIdType& targetName, const MessageIdType& messageName, MESSAGE_PRIORITY priority, Args&&... args) {
+		std::unique_ptr<messageType> envelope(new messageType(detail::emplace_tag(), m_actor->id(), messageName, priority, std::forward<Args>(args)...));
+		if (targetName == m_actor->id()) {
+			return enqueue(std::move(envelope));
 		}
+		return m_mgr.post(targetName, std::move(envelope));
 	}
 	SEND_MESSAGE_RESULT enqueue(std::unique_ptr<messageType> msg) override {
-		return m_messageQueue.push(std::move(msg));
+		msg->enqueuedAt = ActorMetrics::now();
+		message_tracer::global().enqueued(*msg, m_traceTag, m_actor->id());
+		SEND_MESSAGE_RESULT ret = m_messageQueue->push(std::move(msg));
+		m_metrics.sent(ret);
+		return ret;
+	}
+	SEND_MESSAGE_RESULT enqueue(std::vector<std::unique_ptr<messageType>>& msgs) override {
+		size_t n = msgs.size();
+		ActorMetrics::stamp(msgs);
+		traceEnqueue(msgs);
+		SEND_MESSAGE_RESULT ret = m_messageQueue->push(msgs);
+		m_metrics.sent(ret, n, msgs.size());
+		return ret;
+	}
+	MailboxStats mailboxStats() override {
+		return m_messageQueue->stats();
+	}
+	ActorStats stats() override {
+		ActorStats s;
+		m_metrics.snapshot(s);
+		s.depth = m_messageQueue->size();
+		s.mailbox = m_messageQueue->stats();
+		return s;
 	}
 	ActorManager<ActorIdType, MessageIdType, MessageType>* manager()
 	{
 		return &m_mgr;
 	}
 private:
-	volatile bool m_own;
-	volatile bool m_exitFlag;
-	volatile bool m_initDone;
-	volatile bool m_initSucc;
+	void dispatch(std::vector<std::unique_ptr<messageType>>& batch) {
+		uint64_t start = m_metrics.received(batch, batch.size() + m_messageQueue->size());
+		bool traced = message_tracer::global().dequeued(batch, m_traceTag, m_actor->id());
+		m_actor->onMessageBatch(MessageSpan<ActorIdType, MessageIdType, MessageType>(batch.data(), batch.size()));
+		m_metrics.handled(batch.size(), start);
+		if (traced) {
+			message_tracer::global().handled(m_traceTag);
+		}
+		batch.clear();
+	}
+	void traceEnqueue(std::vector<std::unique_ptr<messageType>>& msgs) {
+		if (message_tracer::global().enabled()) {
+			for (auto it = msgs.begin(); it != msgs.end(); ++it) {
+				message_tracer::global().enqueued(**it, m_traceTag, m_actor->id());
+			}
+		}
+	}
+	bool m_own;
+	std::atomic<bool> m_exitFlag;
+	std::atomic<bool> m_initDone;
+	//written before m_initDone.
+	bool m_initSucc;
+	size_t m_batchSize;
+	WaitStrategy m_wait;
+	event_count m_initEvent;
 	Actor<ActorIdType, MessageIdType, MessageType>* m_actor;
 	ActorManager<ActorIdType, MessageIdType, MessageType>& m_mgr;
-	message_queue<std::unique_ptr<messageType>> m_messageQueue;
+	std::unique_ptr<mailbox<messageType>> m_messageQueue;
+	ActorMetrics m_metrics;
+	message_tracer::ActorTag m_traceTag;
 	std::thread m_thread;
 };
 
@@ -215,17 +552,20 @@ template<typename ActorIdType, typename MessageIdType, typename MessageType>
 class ActorImplNoThread : public ActorImplBase<ActorIdType, detail::Message<ActorIdType, MessageIdType, MessageType>> {
 public:
 	typedef typename detail::Message<ActorIdType, MessageIdType, MessageType> messageType;
-	ActorImplNoThread(const ActorIdType& id, ActorManager<ActorIdType, MessageIdType, MessageType>& mgr, Actor<ActorIdType, MessageIdType, MessageType>* actor, bool own, size_t messageQueueOverhead)
-		: m_own(own), m_exitFlag(false), m_initDone(false), m_initSucc(false), m_actor(actor), m_mgr(mgr), m_messageQueue(messageQueueOverhead) {
+	ActorImplNoThread(const ActorIdType& id, ActorManager<ActorIdType, MessageIdType, MessageType>& mgr, ActorNoThread<ActorIdType, MessageIdType, MessageType>* actor, bool own, const MailboxOptions& options)
+		: m_own(own), m_exitFlag(false), m_initDone(false), m_initSucc(false), m_scheduled(false), m_wake(false), m_batchSize(options.batch), m_actor(actor), m_mgr(mgr), m_messageQueue(make_mailbox<messageType>(options)) {
 		actor->m_impl = this;
 		actor->m_id = id;
+		m_messageQueue->onDrop([&mgr](messageType& msg) {
+			mgr.dropped(msg);
+		});
 	}
 	virtual ~ActorImplNoThread() {
 		m_exitFlag = true;
-		m_messageQueue.close();
-		std::unique_ptr<messageType> msg;
-		while (m_messageQueue.try_pop(msg)) {
-			m_actor->onMessage(msg->src, msg->id, *(msg->msg));
+		m_messageQueue->close();
+		std::vector<std::unique_ptr<messageType>> batch;
+		while (m_messageQueue->try_pop(batch, m_batchSize)) {
+			dispatch(batch);
 	}
 #ifdef LOG4CPP_CATEGORY_NAME
 		std::ostringstream ss;
@@ -253,32 +593,91 @@ public:
 #ifdef LOG4CPP_CATEGORY_NAME
 		log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("Actor[%s] onEnter exit [%s].", name.c_str(), m_initSucc ? "true" : "false");
 #endif
+		//messages arrived during onEnter are held back by Poll.
+		if (m_initSucc && (!m_messageQueue->empty() || m_wake.load())) {
+			schedule();
+		}
 		return m_initSucc;
 	}
+	//run by one pool thread at a time, only after schedule() put us on the run queue.
 	void Poll() override {
-		std::unique_ptr<messageType> msg;
-		while(!m_exitFlag) {
-			if (!m_messageQueue.try_pop(msg)) {
-				break;
+		//the run queue does not own us, m_self kept us alive while queued.
+		std::shared_ptr<ActorImplBase<ActorIdType, messageType>> self(std::move(m_self));
+		if (m_initDone && m_initSucc) {
+			if (m_wake.exchange(false)) {
+				m_actor->onWake();
 			}
-			m_actor->onMessage(msg->src, msg->id, *(msg->msg));
+			for (size_t budget = POLL_BUDGET; budget > 0 && !m_exitFlag;) {
+				size_t n = m_messageQueue->try_pop(m_batch, budget < m_batchSize ? budget : m_batchSize);
+				if (n == 0) {
+					break;
+				}
+				dispatch(m_batch);
+				budget -= n;
+			}
+		}
+		m_scheduled.store(false);
+		//a producer may have seen m_scheduled still set, or the budget ran out.
+		if (m_initDone && m_initSucc && (!m_messageQueue->empty() || m_wake.load())) {
+			schedule(true);
 		}
 	}
 	bool InThreadPool() override {
 		return true;
 	}
-	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg) {
+	void wake() {
+		m_wake.store(true);
+		schedule();
+	}
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority) {
 		if (targetName == m_actor->id())
 		{
-			return enqueue(std::unique_ptr<messageType>(new messageType(targetName, messageName, msg)));
+			return enqueue(std::unique_ptr<messageType>(new messageType(targetName, messageName, msg, priority)));
 		}
 		else
 		{
-			return m_mgr.sendMessage(m_actor->id(), targetName, messageName, msg);
+			return m_mgr.sendMessage(m_actor->id(), targetName, messageName, msg, priority);
+		}
+	}
+	template<typename ...Args>
+	SEND_MESSAGE_RESULT emplaceMessage(const ActorIdType& targetName, const MessageIdType& messageName, MESSAGE_PRIORITY priority, Args&&... args) {
+		std::unique_ptr<messageType> envelope(new messageType(detail::emplace_tag(), m_actor->id(), messageName, priority, std::forward<Args>(args)...));
+		if (targetName == m_actor->id()) {
+			return enqueue(std::move(envelope));
 		}
+		return m_mgr.post(targetName, std::move(envelope));
 	}
 	SEND_MESSAGE_RESULT enqueue(std::unique_ptr<messageType> msg) override {
-		return m_messageQueue.push(std::move(msg));
+		msg->enqueuedAt = ActorMetrics::now();
+		message_tracer::global().enqueued(*msg, m_traceTag, m_actor->id());
+		auto ret = m_messageQueue->push(std::move(msg));
+		m_metrics.sent(ret);
+		if (ret == E_SMR_OK || ret == E_SMR_OVERHEAD) {
+			schedule();
+		}
+		return ret;
+	}
+	SEND_MESSAGE_RESULT enqueue(std::vector<std::unique_ptr<messageType>>& msgs) override {
+		size_t n = msgs.size();
+		ActorMetrics::stamp(msgs);
+		traceEnqueue(msgs);
+		auto ret = m_messageQueue->push(msgs);
+		m_metrics.sent(ret, n, msgs.size());
+		//a bounded mailbox may have taken only part of it.
+		if (msgs.size() < n) {
+			schedule();
+		}
+		return ret;
+	}
+	MailboxStats mailboxStats() override {
+		return m_messageQueue->stats();
+	}
+	ActorStats stats() override {
+		ActorStats s;
+		m_metrics.snapshot(s);
+		s.depth = m_messageQueue->size();
+		s.mailbox = m_messageQueue->stats();
+		return s;
 	}
 	ActorManager<ActorIdType, MessageIdType, MessageType>* manager()
 	{
@@ -288,13 +687,51 @@ public:
 		return m_actor->id();
 	}
 private:
+	enum { POLL_BUDGET = 64 };
+	void dispatch(std::vector<std::unique_ptr<messageType>>& batch) {
+		uint64_t start = m_metrics.received(batch, batch.size() + m_messageQueue->size());
+		bool traced = message_tracer::global().dequeued(batch, m_traceTag, m_actor->id());
+		m_actor->onMessageBatch(MessageSpan<ActorIdType, MessageIdType, MessageType>(batch.data(), batch.size()));
+		m_metrics.handled(batch.size(), start);
+		if (traced) {
+			message_tracer::global().handled(m_traceTag);
+		}
+		batch.clear();
+	}
+	void traceEnqueue(std::vector<std::unique_ptr<messageType>>& msgs) {
+		if (message_tracer::global().enabled()) {
+			for (auto it = msgs.begin(); it != msgs.end(); ++it) {
+				message_tracer::global().enqueued(**it, m_traceTag, m_actor->id());
+			}
+		}
+	}
+	//only the caller which flips m_scheduled puts us on the run queue.
+	void schedule(bool yield = false) {
+		if (m_scheduled.load() || m_scheduled.exchange(true)) {
+			return;
+		}
+		m_self = this->shared_from_this();
+		if (!m_mgr.schedule(this, yield)) {
+			//pool stopped, the destructor drains the mailbox.
+			m_self.reset();
+		}
+	}
 	volatile bool m_own;
 	volatile bool m_exitFlag;
-	volatile bool m_initDone;
+	std::atomic<bool> m_initDone;
 	volatile bool m_initSucc;
-	Actor<ActorIdType, MessageIdType, MessageType>* m_actor;
+	std::atomic<bool> m_scheduled;
+	//ActorNoThread::wake was called.
+	std::atomic<bool> m_wake;
+	size_t m_batchSize;
+	//only touched by Poll, kept to reuse its capacity.
+	std::vector<std::unique_ptr<messageType>> m_batch;
+	std::shared_ptr<ActorImplBase<ActorIdType, messageType>> m_self;
+	ActorNoThread<ActorIdType, MessageIdType, MessageType>* m_actor;
 	ActorManager<ActorIdType, MessageIdType, MessageType>& m_mgr;
-	message_queue<std::unique_ptr<messageType>> m_messageQueue;
+	std::unique_ptr<mailbox<messageType>> m_messageQueue;
+	ActorMetrics m_metrics;
+	message_tracer::ActorTag m_traceTag;
 };
 
 template<typename ActorIdType, typename MessageIdType, typename MessageType>
@@ -307,110 +744,450 @@ ActorManager<ActorIdType, MessageIdType, MessageType>* Actor<ActorIdType, Messag
 	return nullptr;
 }
 
+template<typename ActorIdType, typename MessageIdType, typename MessageType>
+ActorManager<ActorIdType, MessageIdType, MessageType>* ActorNoThread<ActorIdType, MessageIdType, MessageType>::manager()
+{
+	if (m_impl)
+	{
+		return m_impl->manager();
+	}
+	return nullptr;
+}
+
+template<typename ActorIdType, typename MessageIdType, typename MessageType>
+void ActorNoThread<ActorIdType, MessageIdType, MessageType>::wake()
+{
+	if (m_impl)
+	{
+		m_impl->wake();
+	}
+}
+
+template<typename ActorIdType, typename MessageIdType, typename MessageType>
+std::weak_ptr<void> ActorNoThread<ActorIdType, MessageIdType, MessageType>::lifetime() const
+{
+	if (m_impl)
+	{
+		return std::weak_ptr<void>(m_impl->shared_from_this());
+	}
+	return std::weak_ptr<void>();
+}
+
+//ActorIdType needs to be copyable and have operator<, timers and sendBatch to several
+//targets group by it in a std::map. Ids that also have std::hash and operator== are
+//looked up in a lock-free hash map, see actor_registry_policy.
 template<typename ActorIdType, typename MessageIdType, typename MessageType>
 class ActorManager
 {
 	typedef ActorImplBase<ActorIdType, detail::Message<ActorIdType, MessageIdType, MessageType>> ActorHolder;
 	typedef detail::Message<ActorIdType, MessageIdType, MessageType> messageType;
+	typedef detail::ActorCell<ActorIdType, ActorHolder> ActorCell;
+	struct ActorEntry {
+		ActorEntry() : unguarded(false) {}
+		std::shared_ptr<ActorHolder> holder;
+		std::shared_ptr<ActorCell> cell;
+		bool unguarded;
+	};
+	struct TimerMessage {
+		TimerMessage() : source(), target(), id(), priority(E_MP_NORMAL), clone(nullptr), ask(0) {}
+		ActorIdType source;
+		ActorIdType target;
+		MessageIdType id;
+		std::unique_ptr<MessageType> msg;
+		MESSAGE_PRIORITY priority;
+		//periodic timers keep msg and send a copy each time.
+		MessageType* (*clone)(const MessageType*);
+		//not a message but the timeout of this ask.
+		uint64_t ask;
+		//or not a message but a call, see callAfter.
+		std::function<void()> call;
+	};
 public:
-	ActorManager(unsigned int threadPoolSize = 1) : m_actorQueue(0), m_threadGroup("am"), m_exitFlag(false) {
-		if (threadPoolSize == 0) {
-			threadPoolSize = std::thread::hardware_concurrency();
-		}
-		for(unsigned int i=0; i<threadPoolSize; i++) {
+	//0 is never a valid timer.
+	typedef uint64_t TimerId;
+	//one message of a multi-target sendBatch.
+	struct BatchMessage {
+		BatchMessage(const ActorIdType& target_, const MessageIdType& id_, MessageType* msg_) : target(target_), id(id_), msg(msg_) {}
+		ActorIdType target;
+		MessageIdType id;
+		MessageType* msg;
+	};
+	//wait is how idle pool threads wait for work, actors with their own thread take
+	//theirs from MailboxOptions::wait.
+	ActorManager(unsigned int threadPoolSize = 1, const WaitStrategy& wait = WaitStrategy()) : m_scheduler(poolSize(threadPoolSize), wait), m_threadGroup("am"), m_exitFlag(false), m_timersCreated(false) {
+		for(unsigned int i=0; i<m_scheduler.workers(); i++) {
 			char thrName[256] = { 0 };
 			snprintf(thrName, sizeof(thrName), "pool-%03d", i + 1);
-			m_threadGroup.Attach(thrName, std::bind(&ActorManager<ActorIdType, MessageIdType, MessageType>::pollRoutine, this, std::placeholders::_1));
+			m_threadGroup.Attach(thrName, std::bind(&ActorManager<ActorIdType, MessageIdType, MessageType>::pollRoutine, this, i, std::placeholders::_1));
 		}
 		m_threadGroup.WaitInitDone();
 	}
 	~ActorManager() {
-		m_actorQueue.close();
+		//no timer may fire into a half destroyed manager, actors may still cancel theirs.
+		if (m_timersCreated.load(std::memory_order_acquire)) {
+			m_timers->stop();
+		}
+		m_scheduler.close();
 		m_exitFlag = true;
 		m_threadGroup.Join();
-		std::map<ActorIdType, std::shared_ptr<ActorHolder>> actors;
-		{
-			std::lock_guard<shared_mutex> lck(m_actorMutex);
-			actors.swap(m_actors);
+		std::vector<ActorEntry> actors = m_actors.drain();
+		for (auto it = actors.begin(); it != actors.end(); ++it) {
+			it->cell->target.store(nullptr);
 		}
+		rcu_domain::global().synchronize();
 		//process pending message
-		std::shared_ptr<ActorHolder> actor;
-		while(m_actorQueue.try_pop(actor)) {
+		while(ActorHolder* actor = m_scheduler.try_pop()) {
 			actor->Poll();
 		}
 	}
-	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& sourceName, const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg) {
-		std::shared_ptr<ActorHolder> holder;
-		{
-			shared_lock<shared_mutex> lck(m_actorMutex);
-			auto it = m_actors.find(targetName);
-			if (it != m_actors.end()) {
-				holder = it->second;
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& sourceName, const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) {
+		return post(targetName, std::unique_ptr<messageType>(new messageType(sourceName, messageName, msg, priority)));
+	}
+	//msg is moved into the envelope, small payloads are stored inline, see detail::payload.
+	SEND_MESSAGE_RESULT sendMessage(const ActorIdType& sourceName, const ActorIdType& targetName, const MessageIdType& messageName, MessageType&& msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) {
+		return post(targetName, std::unique_ptr<messageType>(new messageType(detail::emplace_tag(), sourceName, messageName, priority, std::move(msg))));
+	}
+	//the payload is constructed from args inside the envelope, normal priority.
+	template<typename ...Args>
+	SEND_MESSAGE_RESULT emplaceMessage(const ActorIdType& sourceName, const ActorIdType& targetName, const MessageIdType& messageName, Args&&... args) {
+		return post(targetName, std::unique_ptr<messageType>(new messageType(detail::emplace_tag(), sourceName, messageName, E_MP_NORMAL, std::forward<Args>(args)...)));
+	}
+	//send msg and get the target's reply() through the future, usable from any thread.
+	//the future completes with why the send failed (E_SMR_REJECTED from a full bounded
+	//mailbox, ...), with E_SMR_DROPPED if E_BP_DROP_OLDEST later discards the request,
+	//and with a timeout as E_SMR_TIMEOUT if no reply came in time. Without a timeout an
+	//ask whose target goes away never completes.
+	AskFuture<MessageType> ask(const ActorIdType& sourceName, const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero(), MESSAGE_PRIORITY priority = E_MP_NORMAL) {
+		std::unique_ptr<messageType> envelope(new messageType(sourceName, messageName, msg, priority));
+		uint64_t token = m_asks.acquire();
+		AskFuture<MessageType> future(&m_asks, token);
+		envelope->replyToken = token;
+		if (timeout.count() > 0) {
+			TimerMessage t;
+			t.ask = token;
+			m_asks.setTimer(token, timers().add(ticks(timeout), 0, std::move(t)));
+		}
+		SEND_MESSAGE_RESULT ret = post(targetName, std::move(envelope));
+		if (ret != E_SMR_OK && ret != E_SMR_OVERHEAD) {
+			completeAsk(token, ret, nullptr);
+		}
+		return future;
+	}
+	//answer request on behalf of sourceName, see Actor::reply.
+	//E_SMR_NOTFOUND if the ask already timed out or was answered.
+	SEND_MESSAGE_RESULT reply(const ActorIdType& sourceName, const messageType& request, MessageType* msg) {
+		if (request.replyToken == 0) {
+			return sendMessage(sourceName, request.src, request.id, msg);
+		}
+		return completeAsk(request.replyToken, E_SMR_OK, msg) ? E_SMR_OK : E_SMR_NOTFOUND;
+	}
+	//complete request's ask with status instead of a reply, for an actor that cannot answer.
+	//false if request is no ask or the ask already completed.
+	bool refuse(const messageType& request, SEND_MESSAGE_RESULT status) {
+		return refuse(request.replyToken, status);
+	}
+	//the same by Message::replyToken, for when the request itself is gone.
+	bool refuse(uint64_t replyToken, SEND_MESSAGE_RESULT status) {
+		return replyToken != 0 && completeAsk(replyToken, status, nullptr);
+	}
+	//range of std::pair<MessageIdType, MessageType*>, one lookup and at most one wakeup for the batch.
+	//the manager owns every msg afterwards, rejected ones are deleted.
+	template<typename Iterator>
+	SendBatchResult sendBatch(const ActorIdType& sourceName, const ActorIdType& targetName, Iterator first, Iterator last) {
+		std::vector<std::unique_ptr<messageType>> batch;
+		for (; first != last; ++first) {
+			batch.emplace_back(new messageType(sourceName, first->first, first->second));
+		}
+		return enqueueBatch(targetName, batch);
+	}
+	//range of MessageType*, all sent as messageName.
+	template<typename Iterator>
+	SendBatchResult sendBatch(const ActorIdType& sourceName, const ActorIdType& targetName, const MessageIdType& messageName, Iterator first, Iterator last) {
+		std::vector<std::unique_ptr<messageType>> batch;
+		for (; first != last; ++first) {
+			batch.emplace_back(new messageType(sourceName, messageName, *first));
+		}
+		return enqueueBatch(targetName, batch);
+	}
+	//range of BatchMessage, grouped by target keeping the order per target.
+	//one result per target, in order of first appearance.
+	template<typename Iterator>
+	std::vector<std::pair<ActorIdType, SendBatchResult>> sendBatch(const ActorIdType& sourceName, Iterator first, Iterator last) {
+		std::vector<std::pair<ActorIdType, SendBatchResult>> results;
+		std::vector<std::vector<std::unique_ptr<messageType>>> batches;
+		std::map<ActorIdType, size_t> groups;
+		for (; first != last; ++first) {
+			auto it = groups.find(first->target);
+			if (it == groups.end()) {
+				it = groups.insert(std::make_pair(first->target, batches.size())).first;
+				batches.push_back(std::vector<std::unique_ptr<messageType>>());
+				results.push_back(std::make_pair(first->target, SendBatchResult()));
 			}
+			batches[it->second].emplace_back(new messageType(sourceName, first->id, first->msg));
 		}
-		if (!holder)
-		{
-			delete msg;
-			return E_SMR_NOTFOUND;
+		for (size_t i = 0; i < batches.size(); i++) {
+			results[i].second = enqueueBatch(results[i].first, batches[i]);
 		}
-		return holder->enqueue(std::unique_ptr<messageType>(new messageType(sourceName, messageName, msg)));
+		return results;
+	}
+	//deliver msg after delay, from the timer thread.
+	//the target is looked up when the timer fires, not now.
+	TimerId sendAfter(std::chrono::milliseconds delay, const ActorIdType& sourceName, const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) {
+		TimerMessage t;
+		t.source = sourceName;
+		t.target = targetName;
+		t.id = messageName;
+		t.msg.reset(msg);
+		t.priority = priority;
+		return timers().add(ticks(delay), 0, std::move(t));
+	}
+	//deliver a copy of msg every period, the first one after delay, until cancelTimer.
+	TimerId schedulePeriodic(std::chrono::milliseconds delay, std::chrono::milliseconds period, const ActorIdType& sourceName, const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, MESSAGE_PRIORITY priority = E_MP_NORMAL) {
+		TimerMessage t;
+		t.source = sourceName;
+		t.target = targetName;
+		t.id = messageName;
+		t.msg.reset(msg);
+		t.priority = priority;
+		t.clone = &ActorManager::cloneMessage;
+		uint64_t p = ticks(period);
+		return timers().add(ticks(delay), p == 0 ? 1 : p, std::move(t));
+	}
+	//run fn on the timer thread after delay, it must be short and must not block.
+	TimerId callAfter(std::chrono::milliseconds delay, std::function<void()> fn) {
+		TimerMessage t;
+		t.call = std::move(fn);
+		return timers().add(ticks(delay), 0, std::move(t));
 	}
-	bool registerActor(const ActorIdType& name, Actor<ActorIdType, MessageIdType, MessageType>* actor, size_t messageQueueOverhead = 1024) {
-		std::shared_ptr<ActorHolder> holder(new ActorImpl<ActorIdType, MessageIdType, MessageType>(name, *this, actor, true, messageQueueOverhead));
-		return registerActor(name, holder);
+	//false if it already fired or was cancelled.
+	bool cancelTimer(TimerId timer) {
+		timer_wheel<TimerMessage>* timers = m_timersCreated.load(std::memory_order_acquire) ? m_timers.get() : nullptr;
+		return timers ? timers->cancel(timer) : false;
 	}
-	bool registerActor(const ActorIdType& name, Actor<ActorIdType, MessageIdType, MessageType>& actor, size_t messageQueueOverhead = 1024) {
-		std::shared_ptr<ActorHolder> holder(new ActorImpl<ActorIdType, MessageIdType, MessageType>(name, *this, &actor, false, messageQueueOverhead));
-		return registerActor(name, holder);
+	bool registerActor(const ActorIdType& name, Actor<ActorIdType, MessageIdType, MessageType>* actor, const MailboxOptions& options = MailboxOptions()) {
+		std::shared_ptr<ActorHolder> holder(new ActorImpl<ActorIdType, MessageIdType, MessageType>(name, *this, actor, true, options));
+		return registerActor(name, holder, options);
 	}
-	bool registerActor(const ActorIdType& name, ActorNoThread<ActorIdType, MessageIdType, MessageType>* actor, size_t messageQueueOverhead = 1024) {
-		std::shared_ptr<ActorHolder> holder(new ActorImplNoThread<ActorIdType, MessageIdType, MessageType>(name, *this, actor, true, messageQueueOverhead));
-		return registerActor(name, holder);
+	bool registerActor(const ActorIdType& name, Actor<ActorIdType, MessageIdType, MessageType>& actor, const MailboxOptions& options = MailboxOptions()) {
+		std::shared_ptr<ActorHolder> holder(new ActorImpl<ActorIdType, MessageIdType, MessageType>(name, *this, &actor, false, options));
+		return registerActor(name, holder, options);
 	}
-	bool registerActor(const ActorIdType& name, ActorNoThread<ActorIdType, MessageIdType, MessageType>& actor, size_t messageQueueOverhead = 1024) {
-		std::shared_ptr<ActorHolder> holder(new ActorImplNoThread<ActorIdType, MessageIdType, MessageType>(name, *this, &actor, false, messageQueueOverhead));
-		return registerActor(name, holder);
+	bool registerActor(const ActorIdType& name, ActorNoThread<ActorIdType, MessageIdType, MessageType>* actor, const MailboxOptions& options = MailboxOptions()) {
+		std::shared_ptr<ActorHolder> holder(new ActorImplNoThread<ActorIdType, MessageIdType, MessageType>(name, *this, actor, true, options));
+		return registerActor(name, holder, options);
+	}
+	bool registerActor(const ActorIdType& name, ActorNoThread<ActorIdType, MessageIdType, MessageType>& actor, const MailboxOptions& options = MailboxOptions()) {
+		std::shared_ptr<ActorHolder> holder(new ActorImplNoThread<ActorIdType, MessageIdType, MessageType>(name, *this, &actor, false, options));
+		return registerActor(name, holder, options);
+	}
+	ActorRef<ActorIdType, MessageIdType, MessageType> ref(const ActorIdType& name) {
+		rcu_read_guard guard;
+		ActorEntry* entry = m_actors.find(name);
+		if (!entry) {
+			return ActorRef<ActorIdType, MessageIdType, MessageType>();
+		}
+		return ActorRef<ActorIdType, MessageIdType, MessageType>(entry->cell);
 	}
 	void releaseActor(const ActorIdType& name) {
-		std::shared_ptr<ActorHolder> holder;
-		{
-			std::lock_guard<shared_mutex> lck(m_actorMutex);
-			auto it = m_actors.find(name);
-			if (it != m_actors.end()) {
-				holder = it->second;
-				m_actors.erase(it);
-			} else {
+		if (!removeActor(name)) {
 #ifdef LOG4CPP_CATEGORY_NAME
-				std::ostringstream ss;
-				ss << "actor:" << name;
-				std::string name2 = ss.str();
-				log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("release Actor[%s] notFound.", name2.c_str());
+			std::ostringstream ss;
+			ss << "actor:" << name;
+			std::string name2 = ss.str();
+			log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("release Actor[%s] notFound.", name2.c_str());
 #endif
-			}
 		}
 	}
 	bool hasActor(const ActorIdType& name) {
-		shared_lock<shared_mutex> lck(m_actorMutex);
-		return m_actors.find(name) != m_actors.end();
+		return m_actors.contains(name);
 	}
-	void pollRoutine(ThreadGroup::InitDone done) {
+	//backpressure counters of the actor's mailbox, false if there is no such actor.
+	bool mailboxStats(const ActorIdType& name, MailboxStats& stats) {
+		rcu_read_guard guard;
+		ActorEntry* entry = m_actors.find(name);
+		if (!entry) {
+			return false;
+		}
+		stats = entry->holder->mailboxStats();
+		return true;
+	}
+	//runtime metrics of one actor, false if there is no such actor.
+	bool stats(const ActorIdType& name, ActorStats& stats) {
+		std::shared_ptr<ActorHolder> holder;
+		{
+			rcu_read_guard guard;
+			ActorEntry* entry = m_actors.find(name);
+			if (!entry) {
+				return false;
+			}
+			holder = entry->holder;
+		}
+		stats = holder->stats();
+		return true;
+	}
+	//runtime metrics of every registered actor, cheap enough to poll from a monitor thread.
+	std::vector<std::pair<ActorIdType, ActorStats>> stats() {
+		std::vector<std::shared_ptr<ActorHolder>> holders;
+		{
+			//only collect under the guard, copying histograms would hold up releaseActor.
+			rcu_read_guard guard;
+			m_actors.forEach([&holders](const ActorIdType&, const ActorEntry& entry) {
+				holders.push_back(entry.holder);
+			});
+		}
+		std::vector<std::pair<ActorIdType, ActorStats>> result;
+		result.reserve(holders.size());
+		for (auto it = holders.begin(); it != holders.end(); ++it) {
+			result.push_back(std::make_pair((*it)->id(), (*it)->stats()));
+		}
+		return result;
+	}
+	//integer ids only: an unused id for registerActor, tagged with its slot's generation
+	//so messages to an id that was released and reused are dropped as notFound.
+	ActorIdType allocateId() {
+		return m_actors.allocate();
+	}
+#ifndef ACTOR_NO_MESSAGE_POOL
+	//chunks counts the real mallocs behind the envelope pool.
+	static slab_stats envelopeStats() {
+		return messageType::allocatorStats();
+	}
+#endif
+	void pollRoutine(unsigned int index, ThreadGroup::InitDone done) {
+		char thrName[32] = { 0 };
+		snprintf(thrName, sizeof(thrName), "pool-%03d", index + 1);
+		message_tracer::nameThread(thrName);
+		m_scheduler.attach(index);
 		done();
 		while(!m_exitFlag) {
-			std::shared_ptr<ActorHolder> actor;
-			if (!m_actorQueue.pop(actor)) {
+			ActorHolder* actor = m_scheduler.pop(index);
+			if (!actor) {
 				continue;
 			}
 			actor->Poll();
-			{
-				std::lock_guard<shared_mutex> lck(m_actorMutex);
-				if (m_actors.find(actor->id()) != m_actors.end()) {
-					m_actorQueue.push(std::move(actor));
-				}
-			}
 		}
 	}
 private:
-	bool registerActor(const ActorIdType& name, std::shared_ptr<ActorHolder> actor) {
+	friend class ActorImpl<ActorIdType, MessageIdType, MessageType>;
+	friend class ActorImplNoThread<ActorIdType, MessageIdType, MessageType>;
+	static unsigned int poolSize(unsigned int threadPoolSize) {
+		if (threadPoolSize == 0) {
+			threadPoolSize = std::thread::hardware_concurrency();
+		}
+		return threadPoolSize == 0 ? 1 : threadPoolSize;
+	}
+	//the scheduler only holds actors with pending messages, pool threads park when there is nothing to run.
+	//scheduled from a pool thread the actor goes to that thread's own deque, yield puts it behind everybody.
+	bool schedule(ActorHolder* actor, bool yield) {
+		return yield ? m_scheduler.yield(actor) : m_scheduler.push(actor);
+	}
+	static uint64_t ticks(std::chrono::milliseconds ms) {
+		return ms.count() > 0 ? static_cast<uint64_t>(ms.count()) : 0;
+	}
+	static MessageType* cloneMessage(const MessageType* msg) {
+		return msg ? new MessageType(*msg) : nullptr;
+	}
+	//the timer thread only starts with the first timer.
+	timer_wheel<TimerMessage>& timers() {
+		std::call_once(m_timersOnce, [this]() {
+			m_timers.reset(new timer_wheel<TimerMessage>(std::bind(&ActorManager::deliverTimers, this, std::placeholders::_1)));
+			m_timersCreated.store(true, std::memory_order_release);
+		});
+		return *m_timers;
+	}
+	//timer thread: one mailbox operation per target for everything due in this tick.
+	void deliverTimers(std::vector<TimerMessage*>& due) {
+		std::map<ActorIdType, std::vector<std::unique_ptr<messageType>>> batches;
+		for (auto it = due.begin(); it != due.end(); ++it) {
+			TimerMessage* t = *it;
+			if (t->ask) {
+				completeAsk(t->ask, E_SMR_TIMEOUT, nullptr);
+				continue;
+			}
+			if (t->call) {
+				t->call();
+				continue;
+			}
+			MessageType* msg = t->clone ? t->clone(t->msg.get()) : t->msg.release();
+			batches[t->target].emplace_back(new messageType(t->source, t->id, msg, t->priority));
+		}
+		for (auto it = batches.begin(); it != batches.end(); ++it) {
+			enqueueBatch(it->first, it->second);
+		}
+	}
+	//a mailbox discarded msg after accepting it, an ask waiting on it completes with E_SMR_DROPPED.
+	//the ask's continuation runs right here, so mailboxes that drop are never pushed to
+	//inside a read section, see ActorEntry::unguarded.
+	void dropped(const messageType& msg) {
+		if (msg.replyToken != 0) {
+			completeAsk(msg.replyToken, E_SMR_DROPPED, nullptr);
+		}
+	}
+	//the first completion wins, a reply also stops the timeout timer.
+	bool completeAsk(uint64_t token, SEND_MESSAGE_RESULT status, MessageType* msg) {
+		uint64_t timer = 0;
+		bool done = m_asks.complete(token, status, std::unique_ptr<MessageType>(msg), timer);
+		if (timer != 0 && status != E_SMR_TIMEOUT) {
+			cancelTimer(timer);
+		}
+		return done;
+	}
+	SEND_MESSAGE_RESULT post(const ActorIdType& targetName, std::unique_ptr<messageType> msg) {
+		message_tracer::global().sent(*msg);
+		std::shared_ptr<ActorHolder> holder;
+		{
+			//releaseActor waits for us before it drops the registry reference.
+			rcu_read_guard guard;
+			ActorEntry* entry = m_actors.find(targetName);
+			if (entry && !entry->unguarded) {
+				return entry->holder->enqueue(std::move(msg));
+			}
+			if (entry) {
+				//a sender waiting for room must not hold up every grace period, and a drop
+				//handler completing an ask may run code that waits for one.
+				holder = entry->holder;
+			}
+		}
+		if (holder) {
+			return holder->enqueue(std::move(msg));
+		}
+		return E_SMR_NOTFOUND;
+	}
+	SendBatchResult enqueueBatch(const ActorIdType& targetName, std::vector<std::unique_ptr<messageType>>& batch) {
+		SendBatchResult ret;
+		size_t n = batch.size();
+		std::shared_ptr<ActorHolder> holder;
+		ret.result = E_SMR_NOTFOUND;
+		{
+			rcu_read_guard guard;
+			ActorEntry* entry = m_actors.find(targetName);
+			if (entry && !entry->unguarded) {
+				ret.result = entry->holder->enqueue(batch);
+			}
+			else if (entry) {
+				holder = entry->holder;
+			}
+		}
+		if (holder) {
+			ret.result = holder->enqueue(batch);
+		}
+		ret.rejected = batch.size();
+		ret.accepted = n - ret.rejected;
+		return ret;
+	}
+	//revoke the ActorRefs first, so the grace period in erase covers them too.
+	bool removeActor(const ActorIdType& name) {
+		{
+			rcu_read_guard guard;
+			ActorEntry* entry = m_actors.find(name);
+			if (entry) {
+				entry->cell->target.store(nullptr);
+			}
+		}
+		ActorEntry entry;
+		return m_actors.erase(name, &entry);
+	}
+	bool registerActor(const ActorIdType& name, std::shared_ptr<ActorHolder> actor, const MailboxOptions& options) {
 		std::shared_ptr<void> defer(nullptr, [name](void*)
 		{
 #ifdef LOG4CPP_CATEGORY_NAME
@@ -421,13 +1198,18 @@ private:
 #endif
 		});
 		try {
-			{
-				std::lock_guard<shared_mutex> lck(m_actorMutex);
-				m_actors.insert(std::make_pair(name, actor));
-				if (actor->InThreadPool()) {
-					std::shared_ptr<ActorHolder> tmp = actor;
-					m_actorQueue.push(std::move(tmp));
-				}
+			ActorEntry entry;
+			entry.holder = actor;
+			entry.unguarded = options.type == E_MBT_BOUNDED && (options.policy == E_BP_BLOCK || options.policy == E_BP_DROP_OLDEST);
+			entry.cell = std::make_shared<ActorCell>(name, actor.get(), entry.unguarded);
+			if (!m_actors.insert(name, entry)) {
+#ifdef LOG4CPP_CATEGORY_NAME
+				std::ostringstream ss;
+				ss << "actor:" << name;
+				std::string name2 = ss.str();
+				log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("register Actor[%s] already exists.", name2.c_str());
+#endif
+				return false;
 			}
 			if (!actor->WaitInitDone())
 			{
@@ -437,8 +1219,7 @@ private:
 				std::string name2 = ss.str();
 				log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("register Actor[%s] WaitInitDoneFailed.", name2.c_str());
 #endif
-				std::lock_guard<shared_mutex> lck(m_actorMutex);
-				m_actors.erase(name);
+				removeActor(name);
 				return false;
 			}
 		}
@@ -449,8 +1230,7 @@ private:
 			std::string name2 = ss.str();
 			log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("register Actor[%s] got exception[%s].", name2.c_str(), e.what());
 #endif
-			std::lock_guard<shared_mutex> lck(m_actorMutex);
-			m_actors.erase(name);
+			removeActor(name);
 			return false;
 		}
 		catch (...) {
@@ -460,15 +1240,17 @@ private:
 			std::string name2 = ss.str();
 			log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("register Actor[%s] got exception[unknown].", name2.c_str());
 #endif
-			std::lock_guard<shared_mutex> lck(m_actorMutex);
-			m_actors.erase(name);
+			removeActor(name);
 			return false;
 		}
 		return true;
 	}
-	shared_mutex m_actorMutex;
-	std::map<ActorIdType, std::shared_ptr<ActorHolder>> m_actors;
-	message_queue<std::shared_ptr<ActorHolder>> m_actorQueue;
+	typename actor_registry_policy<ActorIdType, ActorEntry>::type m_actors;
+	work_stealing_scheduler<ActorHolder> m_scheduler;
 	ThreadGroup m_threadGroup;
 	std::atomic<bool> m_exitFlag;
+	std::once_flag m_timersOnce;
+	std::atomic<bool> m_timersCreated;
+	reply_table<MessageType> m_asks;
+	std::unique_ptr<timer_wheel<TimerMessage>> m_timers;
 };
@@ -0,0 +1,180 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include "design_pattern.h"
+#include "mpsc_queue.h"
+#include "histogram.h"
+#include "mq.h"
+#include "mailbox.h"
+
+//what ActorManager::stats() reports for one actor. Counters run from registration on.
+struct ActorStats
+{
+	ActorStats() : enqueued(0), dequeued(0), depth(0), highWater(0) {
+		for (size_t i = 0; i < E_SMR_RESULTS; i++) {
+			sends[i] = 0;
+		}
+	}
+	//accepted by the mailbox: sends[E_SMR_OK] + sends[E_SMR_OVERHEAD].
+	uint64_t enqueued;
+	//handed to onMessageBatch.
+	uint64_t dequeued;
+	//pending right now.
+	size_t depth;
+	//most pending seen, sampled each time the actor dequeues.
+	size_t highWater;
+	//every message offered to the mailbox, by what enqueue returned. E_SMR_OK and
+	//E_SMR_OVERHEAD were accepted, everything else was not.
+	uint64_t sends[E_SMR_RESULTS];
+	MailboxStats mailbox;
+	//nanoseconds from enqueue until the batch holding the message started.
+	histogram queueDelay;
+	//nanoseconds in onMessageBatch per message: a batch of n counts n times its time / n.
+	histogram handlerTime;
+};
+
+//live counters behind ActorStats, one per actor. Producers each bump a counter stripe
+//picked by thread, the consumer side is written by whoever runs the actor, one at a time.
+//nothing is allocated until the first send and the first dequeue, so idle actors cost
+//a few words. Define ACTOR_NO_METRICS to compile all of it out.
+class ActorMetrics : public noncopyable {
+	enum { STRIPES = 8 };
+	struct Stripe {
+		Stripe() {
+			for (size_t i = 0; i < E_SMR_RESULTS; i++) {
+				sends[i].store(0, std::memory_order_relaxed);
+			}
+		}
+		std::atomic<uint64_t> sends[E_SMR_RESULTS];
+		char pad[detail::CACHE_LINE_SIZE];
+	};
+	struct Consumer {
+		Consumer() : dequeued(0), highWater(0) {}
+		std::atomic<uint64_t> dequeued;
+		std::atomic<size_t> highWater;
+		histogram queueDelay;
+		histogram handlerTime;
+	};
+public:
+	ActorMetrics() : m_stripes(nullptr), m_consumer(nullptr) {}
+	~ActorMetrics() {
+		delete[] m_stripes.load();
+		delete m_consumer.load();
+	}
+	//steady clock nanoseconds, what messages are stamped with.
+	static uint64_t now() {
+#ifndef ACTOR_NO_METRICS
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#else
+		return 0;
+#endif
+	}
+	//producer side, any thread: n messages got result.
+	void sent(SEND_MESSAGE_RESULT result, size_t n = 1) {
+#ifndef ACTOR_NO_METRICS
+		if (n != 0) {
+			stripes()[threadIndex() % STRIPES].sends[result].fetch_add(n, std::memory_order_relaxed);
+		}
+#endif
+	}
+	//a batch of n where the mailbox refused the last rejected, the rest went in.
+	void sent(SEND_MESSAGE_RESULT result, size_t n, size_t rejected) {
+		if (rejected == 0) {
+			sent(result, n);
+			return;
+		}
+		sent(E_SMR_OK, n - rejected);
+		sent(result, rejected);
+	}
+	//stamp every message of a batch about to be enqueued.
+	template<typename Batch>
+	static void stamp(Batch& batch) {
+		uint64_t at = now();
+		for (auto it = batch.begin(); it != batch.end(); ++it) {
+			(*it)->enqueuedAt = at;
+		}
+	}
+	//consumer side: batch was just dequeued, depth messages were pending before that.
+	//returns the start time to pass to handled().
+	template<typename Batch>
+	uint64_t received(const Batch& batch, size_t depth) {
+#ifndef ACTOR_NO_METRICS
+		Consumer* c = consumer();
+		uint64_t start = now();
+		for (auto it = batch.begin(); it != batch.end(); ++it) {
+			uint64_t at = (*it)->enqueuedAt;
+			c->queueDelay.record(start > at ? start - at : 0);
+		}
+		c->dequeued.store(c->dequeued.load(std::memory_order_relaxed) + batch.size(), std::memory_order_relaxed);
+		if (depth > c->highWater.load(std::memory_order_relaxed)) {
+			c->highWater.store(depth, std::memory_order_relaxed);
+		}
+		return start;
+#else
+		(void)batch;
+		(void)depth;
+		return 0;
+#endif
+	}
+	//consumer side: onMessageBatch for n messages returned.
+	void handled(size_t n, uint64_t start) {
+#ifndef ACTOR_NO_METRICS
+		if (n != 0) {
+			uint64_t elapsed = now() - start;
+			m_consumer.load(std::memory_order_relaxed)->handlerTime.record(elapsed / n, n);
+		}
+#else
+		(void)n;
+		(void)start;
+#endif
+	}
+	//any thread, leaves depth and mailbox to the caller.
+	void snapshot(ActorStats& s) const {
+		if (Stripe* stripes = m_stripes.load(std::memory_order_acquire)) {
+			for (size_t i = 0; i < STRIPES; i++) {
+				for (size_t r = 0; r < E_SMR_RESULTS; r++) {
+					s.sends[r] += stripes[i].sends[r].load(std::memory_order_relaxed);
+				}
+			}
+		}
+		s.enqueued = s.sends[E_SMR_OK] + s.sends[E_SMR_OVERHEAD];
+		if (Consumer* c = m_consumer.load(std::memory_order_acquire)) {
+			s.dequeued = c->dequeued.load(std::memory_order_relaxed);
+			s.highWater = c->highWater.load(std::memory_order_relaxed);
+			s.queueDelay = c->queueDelay;
+			s.handlerTime = c->handlerTime;
+		}
+	}
+private:
+	Stripe* stripes() {
+		Stripe* s = m_stripes.load(std::memory_order_acquire);
+		if (s == nullptr) {
+			Stripe* fresh = new Stripe[STRIPES];
+			if (m_stripes.compare_exchange_strong(s, fresh, std::memory_order_acq_rel)) {
+				s = fresh;
+			}
+			else {
+				delete[] fresh;
+			}
+		}
+		return s;
+	}
+	//only the consumer allocates it, readers see it through the release store.
+	Consumer* consumer() {
+		Consumer* c = m_consumer.load(std::memory_order_relaxed);
+		if (c == nullptr) {
+			c = new Consumer;
+			m_consumer.store(c, std::memory_order_release);
+		}
+		return c;
+	}
+	static size_t threadIndex() {
+		static std::atomic<size_t> next(0);
+		static thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed);
+		return index;
+	}
+	std::atomic<Stripe*> m_stripes;
+	std::atomic<Consumer*> m_consumer;
+};
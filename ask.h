@@ -0,0 +1,291 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <cstdint>
+#include "design_pattern.h"
+#include "spin_lock.h"
+#include "mq.h"
+
+//correlation slots for outstanding asks. A slot is taken per ask and given back when the
+//future is done with it, so after warm up an ask allocates nothing. The token handed out
+//is generation << 32 | index: a late reply or timeout for a recycled slot is ignored.
+template<typename T>
+class reply_table : public noncopyable {
+	enum {
+		CHUNK_SLOTS = 256,
+		MAX_CHUNKS = 4096
+	};
+	enum STATE {
+		E_RS_FREE,
+		//a future is waiting for the reply.
+		E_RS_WAITING,
+		//the future registered a continuation and is gone.
+		E_RS_CALLBACK,
+		//the future was dropped, the reply is thrown away.
+		E_RS_ABANDONED,
+		//somebody won the race to complete it and is filling in the result.
+		E_RS_COMPLETING,
+		E_RS_DONE
+	};
+public:
+	typedef std::function<void(SEND_MESSAGE_RESULT, std::unique_ptr<T>)> callback;
+	struct Slot {
+		Slot() : stamp(uint64_t(1) << 32), timer(0), index(0), status(E_SMR_OK) {}
+		std::atomic<uint64_t> stamp;
+		//the timeout timer, if any.
+		std::atomic<uint64_t> timer;
+		uint32_t index;
+		SEND_MESSAGE_RESULT status;
+		std::unique_ptr<T> result;
+		callback then;
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+	reply_table() : m_chunkCount(0) {
+		for (size_t i = 0; i < MAX_CHUNKS; i++) {
+			m_chunks[i].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+	~reply_table() {
+		for (size_t i = 0; i < m_chunkCount; i++) {
+			delete[] m_chunks[i].load(std::memory_order_relaxed);
+		}
+	}
+	//never 0.
+	uint64_t acquire() {
+		Slot* slot = nullptr;
+		{
+			std::lock_guard<spin_lock> lck(m_poolLock);
+			if (m_free.empty()) {
+				grow();
+			}
+			slot = m_free.back();
+			m_free.pop_back();
+		}
+		uint64_t gen = slot->stamp.load(std::memory_order_relaxed) >> 32;
+		slot->stamp.store((gen << 32) | E_RS_WAITING, std::memory_order_release);
+		return (gen << 32) | slot->index;
+	}
+	void setTimer(uint64_t token, uint64_t timer) {
+		Slot* slot = find(token);
+		if (slot) {
+			slot->timer.store(timer, std::memory_order_release);
+		}
+	}
+	//first one wins, false if the ask is already complete or the token is stale.
+	//timer gets the timeout timer that is now pointless, 0 if there is none.
+	bool complete(uint64_t token, SEND_MESSAGE_RESULT status, std::unique_ptr<T> result, uint64_t& timer) {
+		timer = 0;
+		Slot* slot = find(token);
+		if (!slot) {
+			return false;
+		}
+		uint64_t gen = token >> 32;
+		uint64_t stamp = slot->stamp.load(std::memory_order_acquire);
+		for (;;) {
+			if ((stamp >> 32) != gen) {
+				return false;
+			}
+			STATE state = static_cast<STATE>(stamp & 0xff);
+			if (state != E_RS_WAITING && state != E_RS_CALLBACK && state != E_RS_ABANDONED) {
+				return false;
+			}
+			if (!slot->stamp.compare_exchange_weak(stamp, (gen << 32) | E_RS_COMPLETING, std::memory_order_acq_rel)) {
+				continue;
+			}
+			timer = slot->timer.exchange(0, std::memory_order_acq_rel);
+			if (state == E_RS_WAITING) {
+				slot->status = status;
+				slot->result = std::move(result);
+				finish(slot);
+			}
+			else if (state == E_RS_CALLBACK) {
+				callback then(std::move(slot->then));
+				release(slot);
+				then(status, std::move(result));
+			}
+			else {
+				release(slot);
+			}
+			return true;
+		}
+	}
+	bool ready(uint64_t token) const {
+		Slot* slot = find(token);
+		return slot && (slot->stamp.load(std::memory_order_acquire) & 0xff) == E_RS_DONE;
+	}
+	//false if the deadline passed first.
+	bool wait(uint64_t token, const std::chrono::steady_clock::time_point* deadline) {
+		Slot* slot = find(token);
+		std::unique_lock<std::mutex> lck(slot->mutex);
+		auto done = [slot]() { return (slot->stamp.load(std::memory_order_acquire) & 0xff) == E_RS_DONE; };
+		if (!deadline) {
+			slot->cv.wait(lck, done);
+			return true;
+		}
+		return slot->cv.wait_until(lck, *deadline, done);
+	}
+	//only once done, hands the slot back.
+	SEND_MESSAGE_RESULT take(uint64_t token, std::unique_ptr<T>& result) {
+		Slot* slot = find(token);
+		SEND_MESSAGE_RESULT status = slot->status;
+		result = std::move(slot->result);
+		release(slot);
+		return status;
+	}
+	//then runs on the thread completing the ask, or right here if that already happened.
+	void attach(uint64_t token, callback&& then) {
+		Slot* slot = find(token);
+		slot->then = std::move(then);
+		uint64_t stamp = slot->stamp.load(std::memory_order_acquire);
+		if ((stamp & 0xff) == E_RS_WAITING && slot->stamp.compare_exchange_strong(stamp, (stamp & ~uint64_t(0xff)) | E_RS_CALLBACK, std::memory_order_acq_rel)) {
+			return;
+		}
+		wait(token, nullptr);
+		callback fn(std::move(slot->then));
+		std::unique_ptr<T> result;
+		SEND_MESSAGE_RESULT status = take(token, result);
+		fn(status, std::move(result));
+	}
+	//the future went away, whoever completes the ask frees the slot.
+	void abandon(uint64_t token) {
+		Slot* slot = find(token);
+		uint64_t stamp = slot->stamp.load(std::memory_order_acquire);
+		if ((stamp & 0xff) == E_RS_WAITING && slot->stamp.compare_exchange_strong(stamp, (stamp & ~uint64_t(0xff)) | E_RS_ABANDONED, std::memory_order_acq_rel)) {
+			return;
+		}
+		wait(token, nullptr);
+		std::unique_ptr<T> result;
+		take(token, result);
+	}
+private:
+	Slot* find(uint64_t token) const {
+		uint32_t index = static_cast<uint32_t>(token);
+		if (index / CHUNK_SLOTS >= MAX_CHUNKS) {
+			return nullptr;
+		}
+		Slot* chunk = m_chunks[index / CHUNK_SLOTS].load(std::memory_order_acquire);
+		return chunk ? &chunk[index % CHUNK_SLOTS] : nullptr;
+	}
+	void grow() {
+		if (m_chunkCount == MAX_CHUNKS) {
+			throw std::bad_alloc();
+		}
+		Slot* chunk = new Slot[CHUNK_SLOTS];
+		uint32_t base = static_cast<uint32_t>(m_chunkCount * CHUNK_SLOTS);
+		for (uint32_t i = CHUNK_SLOTS; i > 0; --i) {
+			chunk[i - 1].index = base + i - 1;
+			m_free.push_back(&chunk[i - 1]);
+		}
+		m_chunks[m_chunkCount++].store(chunk, std::memory_order_release);
+	}
+	static void finish(Slot* slot) {
+		{
+			std::lock_guard<std::mutex> lck(slot->mutex);
+			uint64_t gen = slot->stamp.load(std::memory_order_relaxed) >> 32;
+			slot->stamp.store((gen << 32) | E_RS_DONE, std::memory_order_release);
+		}
+		slot->cv.notify_all();
+	}
+	void release(Slot* slot) {
+		slot->result.reset();
+		slot->then = nullptr;
+		slot->status = E_SMR_OK;
+		uint64_t gen = (slot->stamp.load(std::memory_order_relaxed) >> 32) + 1;
+		if ((gen & 0xffffffff) == 0) {
+			gen = 1;
+		}
+		slot->stamp.store((gen << 32) | E_RS_FREE, std::memory_order_release);
+		std::lock_guard<spin_lock> lck(m_poolLock);
+		m_free.push_back(slot);
+	}
+	spin_lock m_poolLock;
+	std::atomic<Slot*> m_chunks[MAX_CHUNKS];
+	size_t m_chunkCount;
+	std::vector<Slot*> m_free;
+};
+
+//result of ActorManager::ask. Move only, it must not outlive the manager.
+//get/waitFor block, so from inside an actor use then() instead.
+template<typename T>
+class AskFuture : public noncopyable {
+public:
+	AskFuture() : m_table(nullptr), m_token(0), m_status(E_SMR_NOTFOUND) {}
+	//an ask that failed before it was sent.
+	explicit AskFuture(SEND_MESSAGE_RESULT status) : m_table(nullptr), m_token(0), m_status(status) {}
+	AskFuture(AskFuture&& rhs) : m_table(rhs.m_table), m_token(rhs.m_token), m_status(rhs.m_status) {
+		rhs.m_table = nullptr;
+		rhs.m_token = 0;
+	}
+	AskFuture& operator=(AskFuture&& rhs) {
+		if (this != &rhs) {
+			reset();
+			m_table = rhs.m_table;
+			m_token = rhs.m_token;
+			m_status = rhs.m_status;
+			rhs.m_table = nullptr;
+			rhs.m_token = 0;
+		}
+		return *this;
+	}
+	~AskFuture() {
+		reset();
+	}
+	bool ready() const {
+		return !m_table || m_table->ready(m_token);
+	}
+	bool waitFor(std::chrono::milliseconds timeout) {
+		if (!m_table) {
+			return true;
+		}
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+		return m_table->wait(m_token, &deadline);
+	}
+	//wait for the reply. E_SMR_OK and the reply, E_SMR_TIMEOUT, or why the ask could not be sent.
+	SEND_MESSAGE_RESULT get(std::unique_ptr<T>& reply) {
+		if (!m_table) {
+			SEND_MESSAGE_RESULT status = m_status;
+			m_status = E_SMR_NOTFOUND;
+			return status;
+		}
+		m_table->wait(m_token, nullptr);
+		SEND_MESSAGE_RESULT status = m_table->take(m_token, reply);
+		m_table = nullptr;
+		m_token = 0;
+		return status;
+	}
+	//fn(status, reply) runs on whichever thread completes the ask: the replying actor,
+	//the timer thread on timeout, or this one if it is already complete.
+	void then(typename reply_table<T>::callback fn) {
+		if (!m_table) {
+			SEND_MESSAGE_RESULT status = m_status;
+			m_status = E_SMR_NOTFOUND;
+			fn(status, std::unique_ptr<T>());
+			return;
+		}
+		reply_table<T>* table = m_table;
+		m_table = nullptr;
+		table->attach(m_token, std::move(fn));
+		m_token = 0;
+	}
+private:
+	template<typename A, typename M, typename N>
+	friend class ActorManager;
+	AskFuture(reply_table<T>* table, uint64_t token) : m_table(table), m_token(token), m_status(E_SMR_OK) {}
+	void reset() {
+		if (m_table) {
+			m_table->abandon(m_token);
+			m_table = nullptr;
+			m_token = 0;
+		}
+	}
+	reply_table<T>* m_table;
+	uint64_t m_token;
+	SEND_MESSAGE_RESULT m_status;
+};
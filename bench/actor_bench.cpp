@@ -0,0 +1,404 @@
+//end-to-end ActorManager benchmark, results as JSON on stdout, progress on stderr.
+//every message carries its send time, the receiver files now - sent in a histogram,
+//so latency is per hop and includes the time queued in the mailbox.
+//	pingpong	pairs of actors bouncing one message each: hop latency without load
+//	fanin	n producers flooding one sink
+//	fanout	one producer spraying n sinks round robin
+//	ring	n actors in a ring, every one starts a token: throughput under load
+//	mixed	ring alternating actors with their own thread and pooled ones
+//each scenario runs for every pool size and actor count of the sweep.
+//	actor_bench [--scenario all|pingpong|fanin|fanout|ring|mixed] [--pools 1,2,4]
+//		[--actors 2,16,64] [--messages 200000] [--mailbox mpsc|locked|bounded] [--send pointer|move] [--out file]
+//--send move hands payloads over by value, stored inside the envelope, instead of new'ed.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "actor.h"
+#include "stopwatch.h"
+#include "histogram.h"
+
+namespace {
+	typedef int ActorId;
+	//message ids: how many hops the message has left, GO starts a producer.
+	typedef int MessageId;
+	//payload: detail::stopwatch_now() when it was sent.
+	typedef uint64_t Payload;
+	const MessageId GO = -1;
+
+	//counts down the work a run is waiting for.
+	class Run {
+	public:
+		explicit Run(uint64_t work) : m_remaining(work) {}
+		void done(uint64_t n = 1) {
+			if (m_remaining.fetch_sub(n) == n) {
+				std::lock_guard<std::mutex> lck(m_mutex);
+				m_cv.notify_all();
+			}
+		}
+		bool wait(std::chrono::seconds timeout) {
+			std::unique_lock<std::mutex> lck(m_mutex);
+			return m_cv.wait_for(lck, timeout, [this]() { return m_remaining.load() == 0; });
+		}
+	private:
+		std::atomic<uint64_t> m_remaining;
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+	};
+
+	enum ROLE { E_FORWARD, E_SINK, E_PRODUCER };
+
+	//what a node does with a message, shared by the threaded and the pooled flavour.
+	struct Behavior {
+		Behavior() : role(E_SINK), quota(0), received(0), run(nullptr), move(false) {}
+		ROLE role;
+		//forward: the next actor. producer: the targets, round robin.
+		std::vector<ActorId> targets;
+		//sink: messages to receive. producer: messages to send.
+		uint64_t quota;
+		uint64_t received;
+		histogram latency;
+		Run* run;
+		//send with the moving sendMessage instead of a new'ed payload.
+		bool move;
+	};
+
+	template<typename Base>
+	class Node : public Base {
+	public:
+		explicit Node(Behavior* behavior) : m_b(behavior) {}
+		void onMessage(const ActorId&, const MessageId& hops, const Payload& sent) override {
+			Behavior& b = *m_b;
+			if (hops == GO) {
+				for (uint64_t i = 0; i < b.quota; i++) {
+					send(b.targets[i % b.targets.size()], 0);
+				}
+				return;
+			}
+			uint64_t now = detail::stopwatch_now();
+			b.latency.record(now > sent ? now - sent : 0);
+			if (b.role == E_FORWARD) {
+				if (hops > 0) {
+					send(b.targets[0], hops - 1);
+				}
+				else {
+					b.run->done();
+				}
+			}
+			else if (++b.received == b.quota) {
+				b.run->done();
+			}
+		}
+	private:
+		void send(ActorId target, MessageId hops) {
+			if (m_b->move) {
+				this->sendMessage(target, hops, detail::stopwatch_now());
+			}
+			else {
+				this->sendMessage(target, hops, new Payload(detail::stopwatch_now()));
+			}
+		}
+		Behavior* m_b;
+	};
+
+	typedef ActorManager<ActorId, MessageId, Payload> Manager;
+	typedef Node<Actor<ActorId, MessageId, Payload>> ThreadNode;
+	typedef Node<ActorNoThread<ActorId, MessageId, Payload>> PoolNode;
+
+	struct Options {
+		Options() : messages(200000), mailbox(E_MBT_MPSC), move(false), out(stdout) {}
+		std::vector<std::string> scenarios;
+		std::vector<unsigned> pools;
+		std::vector<unsigned> actors;
+		uint64_t messages;
+		MAILBOX_TYPE mailbox;
+		bool move;
+		FILE* out;
+	};
+
+	struct Result {
+		std::string scenario;
+		unsigned pool;
+		unsigned actors;
+		uint64_t messages;
+		double seconds;
+		bool complete;
+		histogram latency;
+	};
+
+	//one scenario on a fresh manager: builds the actors, kicks them off, waits.
+	class Bench : public noncopyable {
+	public:
+		Bench(const Options& options, unsigned pool) : m_options(options), m_mgr(new Manager(pool)), m_begin(0) {}
+		Behavior* add(bool threaded, ROLE role) {
+			m_behaviors.push_back(std::unique_ptr<Behavior>(new Behavior));
+			Behavior* b = m_behaviors.back().get();
+			b->role = role;
+			b->move = m_options.move;
+			ActorId id = static_cast<ActorId>(m_behaviors.size());
+			//a bounded ring big enough for the whole run: it must not lose messages, and a
+			//blocking policy could stall the one pool thread the receiver needs.
+			MailboxOptions mailbox(m_options.mailbox == E_MBT_BOUNDED ? static_cast<size_t>(m_options.messages) + 1024 : 1024, m_options.mailbox);
+			bool ok = threaded ? m_mgr->registerActor(id, new ThreadNode(b), mailbox) : m_mgr->registerActor(id, new PoolNode(b), mailbox);
+			if (!ok) {
+				fprintf(stderr, "registerActor %d failed\n", id);
+				exit(1);
+			}
+			return b;
+		}
+		static ActorId idOf(size_t index) {
+			return static_cast<ActorId>(index + 1);
+		}
+		void send(ActorId target, MessageId id) {
+			m_mgr->sendMessage(0, target, id, new Payload(detail::stopwatch_now()));
+		}
+		size_t size() const {
+			return m_behaviors.size();
+		}
+		Behavior& behavior(size_t i) {
+			return *m_behaviors[i];
+		}
+		//the clock runs from here to the end of the last piece of work.
+		void start() {
+			m_begin = detail::stopwatch_now();
+		}
+		void finish(Run& run, Result& result) {
+			result.complete = run.wait(std::chrono::seconds(120));
+			result.seconds = (detail::stopwatch_now() - m_begin) / 1e9;
+			for (auto it = m_behaviors.begin(); it != m_behaviors.end(); ++it) {
+				result.latency.merge((*it)->latency);
+			}
+		}
+	private:
+		const Options& m_options;
+		std::vector<std::unique_ptr<Behavior>> m_behaviors;
+		//destroyed first, the actors point into m_behaviors.
+		std::unique_ptr<Manager> m_mgr;
+		uint64_t m_begin;
+	};
+
+	//n actors, each forwarding to the next, tokens start at every stride-th one.
+	void ring(const Options& options, Result& r, unsigned n, unsigned tokens, bool mixed) {
+		Bench bench(options, r.pool);
+		for (unsigned i = 0; i < n; i++) {
+			Behavior* b = bench.add(mixed && i % 2 == 0, E_FORWARD);
+			b->targets.push_back(Bench::idOf((i + 1) % n));
+		}
+		uint64_t hops = std::max<uint64_t>(1, options.messages / tokens);
+		r.messages = hops * tokens;
+		Run run(tokens);
+		for (size_t i = 0; i < bench.size(); i++) {
+			bench.behavior(i).run = &run;
+		}
+		bench.start();
+		for (unsigned t = 0; t < tokens; t++) {
+			bench.send(Bench::idOf(t * (n / tokens)), static_cast<MessageId>(hops - 1));
+		}
+		bench.finish(run, r);
+	}
+
+	void pingpong(const Options& options, Result& r) {
+		unsigned pairs = std::max(1u, r.actors / 2);
+		Bench bench(options, r.pool);
+		for (unsigned p = 0; p < pairs; p++) {
+			Behavior* a = bench.add(false, E_FORWARD);
+			Behavior* b = bench.add(false, E_FORWARD);
+			a->targets.push_back(Bench::idOf(p * 2 + 1));
+			b->targets.push_back(Bench::idOf(p * 2));
+		}
+		uint64_t hops = std::max<uint64_t>(1, options.messages / pairs);
+		r.messages = hops * pairs;
+		Run run(pairs);
+		for (size_t i = 0; i < bench.size(); i++) {
+			bench.behavior(i).run = &run;
+		}
+		bench.start();
+		for (unsigned p = 0; p < pairs; p++) {
+			bench.send(Bench::idOf(p * 2), static_cast<MessageId>(hops - 1));
+		}
+		bench.finish(run, r);
+	}
+
+	//fanin: n producers -> 1 sink. fanout: 1 producer -> n sinks.
+	void fan(const Options& options, Result& r, bool in) {
+		unsigned n = std::max(1u, r.actors - 1);
+		Bench bench(options, r.pool);
+		uint64_t per = std::max<uint64_t>(1, options.messages / n);
+		r.messages = per * n;
+		Run run(in ? 1 : n);
+		std::vector<ActorId> producers;
+		if (in) {
+			Behavior* sink = bench.add(false, E_SINK);
+			sink->quota = r.messages;
+			sink->run = &run;
+			for (unsigned i = 0; i < n; i++) {
+				Behavior* p = bench.add(false, E_PRODUCER);
+				p->quota = per;
+				p->targets.push_back(Bench::idOf(0));
+				producers.push_back(Bench::idOf(i + 1));
+			}
+		}
+		else {
+			Behavior* p = bench.add(false, E_PRODUCER);
+			p->quota = r.messages;
+			producers.push_back(Bench::idOf(0));
+			for (unsigned i = 0; i < n; i++) {
+				Behavior* sink = bench.add(false, E_SINK);
+				sink->quota = per;
+				sink->run = &run;
+				p->targets.push_back(Bench::idOf(i + 1));
+			}
+		}
+		bench.start();
+		for (auto it = producers.begin(); it != producers.end(); ++it) {
+			bench.send(*it, GO);
+		}
+		bench.finish(run, r);
+	}
+
+	std::vector<unsigned> defaultActors(const std::string& scenario) {
+		if (scenario == "pingpong") {
+			return std::vector<unsigned>{2, 8, 32};
+		}
+		if (scenario == "fanin" || scenario == "fanout") {
+			return std::vector<unsigned>{5, 17, 65};
+		}
+		return std::vector<unsigned>{8, 64, 512};
+	}
+
+	Result runOne(const Options& options, const std::string& scenario, unsigned pool, unsigned actors) {
+		Result r;
+		r.scenario = scenario;
+		r.pool = pool;
+		r.actors = actors;
+		r.messages = 0;
+		r.seconds = 0;
+		r.complete = false;
+		if (scenario == "pingpong") {
+			pingpong(options, r);
+		}
+		else if (scenario == "fanin") {
+			fan(options, r, true);
+		}
+		else if (scenario == "fanout") {
+			fan(options, r, false);
+		}
+		else if (scenario == "ring") {
+			ring(options, r, actors, actors, false);
+		}
+		else if (scenario == "mixed") {
+			ring(options, r, actors, std::max(1u, actors / 4), true);
+		}
+		return r;
+	}
+
+	std::vector<unsigned> parseList(const char* s) {
+		std::vector<unsigned> v;
+		for (const char* p = s; *p;) {
+			v.push_back(static_cast<unsigned>(strtoul(p, const_cast<char**>(&p), 10)));
+			if (*p == ',') {
+				p++;
+			}
+			else if (*p) {
+				break;
+			}
+		}
+		return v;
+	}
+
+	void usage() {
+		fprintf(stderr, "actor_bench [--scenario all|pingpong|fanin|fanout|ring|mixed] [--pools 1,2,4] [--actors 2,16,64] [--messages N] [--mailbox mpsc|locked|bounded] [--send pointer|move] [--out file]\n");
+		exit(2);
+	}
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	std::string scenario = "all";
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			usage();
+		}
+		const char* value = argv[++i];
+		if (arg == "--scenario") {
+			scenario = value;
+		}
+		else if (arg == "--pools") {
+			options.pools = parseList(value);
+		}
+		else if (arg == "--actors") {
+			options.actors = parseList(value);
+		}
+		else if (arg == "--messages") {
+			options.messages = strtoull(value, nullptr, 10);
+		}
+		else if (arg == "--mailbox") {
+			std::string m = value;
+			options.mailbox = m == "locked" ? E_MBT_LOCKED : m == "bounded" ? E_MBT_BOUNDED : E_MBT_MPSC;
+		}
+		else if (arg == "--send") {
+			options.move = std::string(value) == "move";
+		}
+		else if (arg == "--out") {
+			options.out = fopen(value, "w");
+			if (!options.out) {
+				perror(value);
+				return 1;
+			}
+		}
+		else {
+			usage();
+		}
+	}
+	if (scenario == "all") {
+		options.scenarios = std::vector<std::string>{"pingpong", "fanin", "fanout", "ring", "mixed"};
+	}
+	else {
+		options.scenarios.push_back(scenario);
+	}
+	if (options.pools.empty()) {
+		unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned p = 1; p < cores; p *= 2) {
+			options.pools.push_back(p);
+		}
+		options.pools.push_back(cores);
+	}
+	const char* mailbox = options.mailbox == E_MBT_LOCKED ? "locked" : options.mailbox == E_MBT_BOUNDED ? "bounded" : "mpsc";
+	fprintf(options.out, "{\"cores\":%u,\"mailbox\":\"%s\",\"send\":\"%s\",\"results\":[\n", std::thread::hardware_concurrency(), mailbox,
+		options.move ? "move" : "pointer");
+	bool first = true;
+	bool failed = false;
+	for (auto s = options.scenarios.begin(); s != options.scenarios.end(); ++s) {
+		std::vector<unsigned> actors = options.actors.empty() ? defaultActors(*s) : options.actors;
+		for (auto p = options.pools.begin(); p != options.pools.end(); ++p) {
+			for (auto a = actors.begin(); a != actors.end(); ++a) {
+				Result r = runOne(options, *s, *p, std::max(2u, *a));
+				double rate = r.seconds > 0 ? r.messages / r.seconds : 0;
+				fprintf(stderr, "%-8s pool %2u actors %4u %12.0f msgs/s p50 %8.2fus p99 %8.2fus%s\n", r.scenario.c_str(), r.pool, r.actors, rate,
+					r.latency.percentile(0.5) / 1000.0, r.latency.percentile(0.99) / 1000.0, r.complete ? "" : " TIMEOUT");
+				fprintf(options.out, "%s{\"scenario\":\"%s\",\"pool\":%u,\"actors\":%u,\"messages\":%llu,\"seconds\":%.6f,\"complete\":%s,"
+					"\"msgs_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu,\"mean_ns\":%.1f}",
+					first ? "" : ",\n", r.scenario.c_str(), r.pool, r.actors, static_cast<unsigned long long>(r.messages), r.seconds, r.complete ? "true" : "false",
+					rate, static_cast<unsigned long long>(r.latency.percentile(0.5)), static_cast<unsigned long long>(r.latency.percentile(0.99)),
+					static_cast<unsigned long long>(r.latency.percentile(0.999)), static_cast<unsigned long long>(r.latency.maximum()), r.latency.mean());
+				fflush(options.out);
+				first = false;
+				failed = failed || !r.complete;
+			}
+		}
+	}
+	fprintf(options.out, "\n]}\n");
+	if (options.out != stdout) {
+		fclose(options.out);
+	}
+	return failed ? 1 : 0;
+}
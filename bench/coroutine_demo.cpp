@@ -0,0 +1,126 @@
+//runs a CoroutineActor through ActorManager and checks what it saw, exit code 1 on failure.
+//every round the coroutine receives a request, sleeps, asks an echo actor and replies
+//with the echo, the last round asks an actor that never answers and times out.
+//a second coroutine throws on its first request, that ask and later ones get E_SMR_CLOSED.
+//	g++ -std=c++20 -O2 -pthread -I.. coroutine_demo.cpp -o coroutine_demo
+//	coroutine_demo [rounds]
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include "coroutine_actor.h"
+
+namespace {
+	typedef int ActorId;
+	typedef int MessageId;
+	typedef long long Payload;
+	typedef ActorManager<ActorId, MessageId, Payload> Manager;
+
+	enum { ECHO = 1, SILENT, WORKER, THROWER };
+	enum { REQUEST, STOP };
+
+	const std::chrono::milliseconds SLEEP(5);
+	//the timer wheel counts whole milliseconds, a timer may fire up to one tick early.
+	const std::chrono::milliseconds TICK(1);
+
+	std::atomic<int> failures(0);
+
+	void check(bool ok, const char* what) {
+		if (!ok) {
+			failures++;
+			fprintf(stderr, "failed: %s\n", what);
+		}
+	}
+
+	struct Echo : ActorNoThread<ActorId, MessageId, Payload> {
+		void onMessage(const ActorId&, const MessageId&, const Payload& msg) override {
+			reply(new Payload(msg * 2));
+		}
+	};
+
+	struct Silent : ActorNoThread<ActorId, MessageId, Payload> {
+		void onMessage(const ActorId&, const MessageId&, const Payload&) override {}
+	};
+
+	struct Worker : CoroutineActor<ActorId, MessageId, Payload> {
+		Worker() : received(0), done(false) {}
+		ActorTask run() override {
+			for (;;) {
+				auto m = co_await receive();
+				received++;
+				if (m->id == STOP) {
+					break;
+				}
+				auto start = std::chrono::steady_clock::now();
+				co_await sleep(SLEEP);
+				check(std::chrono::steady_clock::now() - start >= SLEEP - TICK, "sleep resumed early");
+				auto r = co_await ask(ECHO, REQUEST, new Payload(*m->msg));
+				check(r.status == E_SMR_OK && r.reply && *r.reply == *m->msg * 2, "ask round trip");
+				reply(*m, r.reply.release());
+			}
+			auto t = co_await ask(SILENT, REQUEST, new Payload(0), std::chrono::milliseconds(20));
+			check(t.status == E_SMR_TIMEOUT && !t.reply, "ask timeout");
+			done.store(true);
+		}
+		std::atomic<int> received;
+		std::atomic<bool> done;
+	};
+
+	struct Thrower : CoroutineActor<ActorId, MessageId, Payload> {
+		ActorTask run() override {
+			auto m = co_await receive();
+			throw std::runtime_error("thrown by the body");
+		}
+	};
+
+	bool threw(std::exception_ptr error) {
+		try {
+			if (error) {
+				std::rethrow_exception(error);
+			}
+		}
+		catch (const std::runtime_error& e) {
+			return strcmp(e.what(), "thrown by the body") == 0;
+		}
+		return false;
+	}
+}
+
+int main(int argc, char** argv) {
+	int rounds = argc > 1 ? atoi(argv[1]) : 10;
+	{
+		Manager mgr(2);
+		//owned by mgr, only looked at while registered: a pool thread may still be
+		//finishing with it when releaseActor returns.
+		Worker* worker = new Worker;
+		mgr.registerActor(ECHO, new Echo);
+		mgr.registerActor(SILENT, new Silent);
+		mgr.registerActor(WORKER, worker);
+		for (int i = 0; i < rounds; i++) {
+			std::unique_ptr<Payload> reply;
+			SEND_MESSAGE_RESULT ret = mgr.ask(0, WORKER, REQUEST, new Payload(i), std::chrono::milliseconds(5000)).get(reply);
+			check(ret == E_SMR_OK && reply && *reply == i * 2, "reply from the coroutine");
+		}
+		mgr.sendMessage(0, WORKER, STOP, new Payload(0));
+		for (int i = 0; i < 500 && !worker->done.load(); i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		check(worker->done.load(), "coroutine finished");
+		check(worker->received.load() == rounds + 1, "every message received");
+		mgr.releaseActor(WORKER);
+
+		Thrower* thrower = new Thrower;
+		mgr.registerActor(THROWER, thrower);
+		std::unique_ptr<Payload> reply;
+		check(mgr.ask(0, THROWER, REQUEST, new Payload(1), std::chrono::milliseconds(5000)).get(reply) == E_SMR_CLOSED, "ask the body threw on");
+		check(threw(thrower->error()), "exception kept");
+		check(mgr.ask(0, THROWER, REQUEST, new Payload(2), std::chrono::milliseconds(5000)).get(reply) == E_SMR_CLOSED, "ask after the body stopped");
+		mgr.releaseActor(THROWER);
+	}
+	printf("%d rounds, %d failures\n", rounds, failures.load());
+	return failures.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,431 @@
+//microbenchmarks for the building blocks, results as JSON on stdout, progress on stderr.
+//	queue	n producers push pre-built envelopes, one consumer pops them in batches.
+//		message_queue against the mailboxes an actor can be configured with.
+//	lock	every thread takes the lock, bumps a shared counter and does a little private work.
+//	rwlock	the same with lock_shared for reads% of the operations and lock for the rest.
+//	pool	every thread keeps HOLD objects out, each op frees the oldest and takes a new one.
+//		ObjectPool, the slab and slab_allocated payloads against new/delete.
+//ns_per_op is wall time over all operations of all threads, the inverse of throughput.
+//scaling is ops_per_sec against the 1 thread run of the same impl and read ratio.
+//	primitives_bench [--suite all|queue|lock|rwlock|pool] [--threads 1,2,4,8,16]
+//		[--reads 100,95,50] [--ms 200] [--messages 400000] [--out file]
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include "mq.h"
+#include "mailbox.h"
+#include "spin_lock.h"
+#include "shared_mutex.h"
+#include "br_shared_mutex.h"
+#include "design_pattern.h"
+#include "slab_allocator.h"
+
+namespace {
+	typedef detail::Message<int, int, int> Envelope;
+
+	struct Options {
+		Options() : ms(200), messages(400000), out(stdout) {}
+		std::string suite;
+		std::vector<unsigned> threads;
+		std::vector<unsigned> reads;
+		unsigned ms;
+		uint64_t messages;
+		FILE* out;
+	};
+
+	struct Result {
+		std::string suite;
+		std::string impl;
+		unsigned threads;
+		//rwlock only, -1 elsewhere.
+		int reads;
+		uint64_t ops;
+		double seconds;
+	};
+
+	typedef std::function<void(const Result&)> Reporter;
+
+	//starts the workers together, and for the timed suites stops them after ms.
+	class Race {
+	public:
+		Race() : m_go(false), m_stop(false) {}
+		//fn(t) runs on thread t and returns how many operations it did.
+		uint64_t run(unsigned threads, unsigned ms, const std::function<uint64_t(unsigned)>& fn, double& seconds) {
+			std::vector<uint64_t> counts(threads, 0);
+			std::vector<std::thread> workers;
+			for (unsigned t = 0; t < threads; t++) {
+				workers.emplace_back([&, t]() {
+					while (!m_go.load(std::memory_order_acquire)) {
+						std::this_thread::yield();
+					}
+					counts[t] = fn(t);
+				});
+			}
+			auto begin = std::chrono::steady_clock::now();
+			m_go.store(true, std::memory_order_release);
+			if (ms != 0) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+				m_stop.store(true, std::memory_order_relaxed);
+			}
+			for (auto& w : workers) {
+				w.join();
+			}
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			uint64_t total = 0;
+			for (auto c : counts) {
+				total += c;
+			}
+			return total;
+		}
+		bool stopped() const {
+			return m_stop.load(std::memory_order_relaxed);
+		}
+	private:
+		std::atomic<bool> m_go;
+		std::atomic<bool> m_stop;
+	};
+
+	//a few cycles of work outside the lock, so the threads do not only fight over it.
+	inline void think(unsigned rounds) {
+		volatile uint64_t local = 0;
+		for (unsigned i = 0; i < rounds; i++) {
+			local = local + i;
+		}
+	}
+
+	inline uint32_t xorshift(uint32_t& state) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	//queue: the envelopes are built before the clock starts and freed after it stops,
+	//so only push and pop are measured. Thread 0 is the consumer.
+	template<typename Queue>
+	Result queue(const char* impl, unsigned producers, const Options& options, Queue& q) {
+		Result r = { "queue", impl, producers, -1, 0, 0 };
+		uint64_t per = options.messages / producers;
+		uint64_t total = per * producers;
+		std::vector<std::vector<std::unique_ptr<Envelope>>> made(producers);
+		for (auto& v : made) {
+			v.reserve(per);
+			for (uint64_t i = 0; i < per; i++) {
+				v.emplace_back(new Envelope(0, 0, nullptr));
+			}
+		}
+		std::vector<std::unique_ptr<Envelope>> got;
+		got.reserve(total);
+		Race race;
+		race.run(producers + 1, 0, [&](unsigned t) -> uint64_t {
+			if (t == 0) {
+				while (got.size() < total && q.pop(got, 64)) {
+				}
+				return 0;
+			}
+			for (auto& msg : made[t - 1]) {
+				q.push(std::move(msg));
+			}
+			return 0;
+		}, r.seconds);
+		r.ops = got.size();
+		if (r.ops != total) {
+			fprintf(stderr, "%s lost messages %llu != %llu\n", impl, (unsigned long long)r.ops, (unsigned long long)total);
+			exit(1);
+		}
+		return r;
+	}
+
+	void queues(const Options& options, const Reporter& report) {
+		for (auto producers : options.threads) {
+			{
+				message_queue<std::unique_ptr<Envelope>> q(0);
+				report(queue("message_queue", producers, options, q));
+			}
+			{
+				locked_mailbox<Envelope> q(0);
+				report(queue("locked_mailbox", producers, options, q));
+			}
+			{
+				mpsc_mailbox<Envelope> q(0);
+				report(queue("mpsc_mailbox", producers, options, q));
+			}
+			{
+				//room for the whole run, nothing is refused.
+				bounded_mailbox<Envelope> q(static_cast<size_t>(options.messages), E_BP_REJECT, 0);
+				report(queue("bounded_mailbox", producers, options, q));
+			}
+		}
+	}
+
+	template<typename Lock>
+	Result lock(const char* impl, unsigned threads, const Options& options) {
+		Result r = { "lock", impl, threads, -1, 0, 0 };
+		Lock l;
+		uint64_t counter = 0;
+		Race race;
+		r.ops = race.run(threads, options.ms, [&](unsigned) -> uint64_t {
+			uint64_t n = 0;
+			while (!race.stopped()) {
+				{
+					std::lock_guard<Lock> lck(l);
+					counter++;
+				}
+				think(16);
+				n++;
+			}
+			return n;
+		}, r.seconds);
+		if (r.ops != counter) {
+			fprintf(stderr, "%s lost updates %llu != %llu\n", impl, (unsigned long long)r.ops, (unsigned long long)counter);
+			exit(1);
+		}
+		return r;
+	}
+
+	void locks(const Options& options, const Reporter& report) {
+		for (auto threads : options.threads) {
+			report(lock<std::mutex>("std::mutex", threads, options));
+			report(lock<spin_lock>("spin_lock", threads, options));
+			report(lock<ticket_lock>("ticket_lock", threads, options));
+			report(lock<mcs_lock>("mcs_lock", threads, options));
+		}
+	}
+
+	template<typename Lock>
+	Result rwlock(const char* impl, unsigned threads, unsigned reads, const Options& options) {
+		Result r = { "rwlock", impl, threads, static_cast<int>(reads), 0, 0 };
+		Lock l;
+		uint64_t shared[8] = {};
+		std::atomic<uint64_t> writes(0);
+		Race race;
+		r.ops = race.run(threads, options.ms, [&](unsigned t) -> uint64_t {
+			uint32_t seed = 2463534242u + t * 7919u;
+			uint64_t n = 0, w = 0;
+			volatile uint64_t sink = 0;
+			while (!race.stopped()) {
+				if (xorshift(seed) % 100 < reads) {
+					l.lock_shared();
+					sink = shared[0] + shared[7];
+					l.unlock_shared();
+				}
+				else {
+					l.lock();
+					shared[0]++;
+					shared[7]++;
+					l.unlock();
+					w++;
+				}
+				think(16);
+				n++;
+			}
+			writes.fetch_add(w);
+			(void)sink;
+			return n;
+		}, r.seconds);
+		if (writes.load() != shared[0]) {
+			fprintf(stderr, "%s lost updates %llu != %llu\n", impl, (unsigned long long)writes.load(), (unsigned long long)shared[0]);
+			exit(1);
+		}
+		return r;
+	}
+
+	void rwlocks(const Options& options, const Reporter& report) {
+		for (auto reads : options.reads) {
+			for (auto threads : options.threads) {
+				report(rwlock<std::shared_timed_mutex>("std::shared_timed_mutex", threads, reads, options));
+				report(rwlock<shared_mutex>("shared_mutex", threads, reads, options));
+				report(rwlock<br_shared_mutex>("br_shared_mutex", threads, reads, options));
+			}
+		}
+	}
+
+	struct PoolObject {
+		void reset() {}
+		char data[64];
+	};
+
+	//a payload that news itself from the slab.
+	struct SlabObject : PoolObject, slab_allocated<SlabObject> {
+	};
+
+	//every thread holds HOLD objects in a ring, each op frees the oldest and takes a new one.
+	//alloc returns nullptr when the source is exhausted.
+	enum { HOLD = 16 };
+	template<typename Alloc, typename Free>
+	Result pool(const char* impl, unsigned threads, const Options& options, Alloc alloc, Free free) {
+		Result r = { "pool", impl, threads, -1, 0, 0 };
+		Race race;
+		r.ops = race.run(threads, options.ms, [&](unsigned) -> uint64_t {
+			PoolObject* held[HOLD];
+			for (size_t i = 0; i < HOLD; i++) {
+				held[i] = alloc();
+			}
+			uint64_t n = 0;
+			while (!race.stopped()) {
+				PoolObject*& slot = held[n % HOLD];
+				free(slot);
+				slot = alloc();
+				if (slot == nullptr) {
+					fprintf(stderr, "%s ran dry\n", impl);
+					exit(1);
+				}
+				slot->data[0] = static_cast<char>(n);
+				n++;
+			}
+			for (size_t i = 0; i < HOLD; i++) {
+				free(held[i]);
+			}
+			return n;
+		}, r.seconds);
+		return r;
+	}
+
+	Result objectPool(unsigned threads, const Options& options) {
+		ObjectPool<PoolObject> p(threads * HOLD);
+		p.setGrowth(64);
+		return pool("ObjectPool", threads, options, [&]() { return p.alloc(); }, [&](PoolObject* o) { p.free(o); });
+	}
+
+	void pools(const Options& options, const Reporter& report) {
+		typedef slab_allocator<sizeof(PoolObject)> slab;
+		for (auto threads : options.threads) {
+			report(pool("new/delete", threads, options,
+				[]() { return new PoolObject; }, [](PoolObject* o) { delete o; }));
+			report(pool("slab_allocator", threads, options,
+				[]() { return static_cast<PoolObject*>(slab::allocate()); }, [](PoolObject* o) { slab::deallocate(o); }));
+			report(pool("slab_allocated", threads, options,
+				[]() -> PoolObject* { return new SlabObject; }, [](PoolObject* o) { delete static_cast<SlabObject*>(o); }));
+			report(objectPool(threads, options));
+		}
+	}
+
+	std::vector<unsigned> parseList(const char* s) {
+		std::vector<unsigned> v;
+		for (const char* p = s; *p;) {
+			v.push_back(static_cast<unsigned>(strtoul(p, const_cast<char**>(&p), 10)));
+			if (*p == ',') {
+				p++;
+			}
+			else if (*p) {
+				break;
+			}
+		}
+		return v;
+	}
+
+	void usage() {
+		fprintf(stderr, "primitives_bench [--suite all|queue|lock|rwlock|pool] [--threads 1,2,4,8,16] [--reads 100,95,50] [--ms 200] [--messages N] [--out file]\n");
+		exit(2);
+	}
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	options.suite = "all";
+	options.threads = std::vector<unsigned>{1, 2, 4, 8, 16};
+	options.reads = std::vector<unsigned>{100, 95, 50};
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			usage();
+		}
+		const char* value = argv[++i];
+		if (arg == "--suite") {
+			options.suite = value;
+		}
+		else if (arg == "--threads") {
+			options.threads = parseList(value);
+		}
+		else if (arg == "--reads") {
+			options.reads = parseList(value);
+		}
+		else if (arg == "--ms") {
+			options.ms = static_cast<unsigned>(atoi(value));
+		}
+		else if (arg == "--messages") {
+			options.messages = strtoull(value, nullptr, 10);
+		}
+		else if (arg == "--out") {
+			options.out = fopen(value, "w");
+			if (options.out == nullptr) {
+				fprintf(stderr, "cannot open %s\n", value);
+				return 2;
+			}
+		}
+		else {
+			usage();
+		}
+	}
+	for (auto& t : options.threads) {
+		t = t == 0 ? 1 : t;
+	}
+	for (auto& r : options.reads) {
+		r = r > 100 ? 100 : r;
+	}
+	options.ms = options.ms == 0 ? 1 : options.ms;
+	if (options.messages < 16) {
+		options.messages = 16;
+	}
+	bool all = options.suite == "all";
+	if (!all && options.suite != "queue" && options.suite != "lock" && options.suite != "rwlock" && options.suite != "pool") {
+		usage();
+	}
+
+	fprintf(options.out, "{\"cores\":%u,\"results\":[\n", std::thread::hardware_concurrency());
+	std::vector<Result> results;
+	Reporter report = [&](const Result& r) {
+		size_t printed = results.size();
+		results.push_back(r);
+		double rate = r.seconds > 0 ? r.ops / r.seconds : 0;
+		double base = rate;
+		for (size_t i = 0; i < printed; i++) {
+			const Result& b = results[i];
+			if (b.threads == 1 && b.suite == r.suite && b.impl == r.impl && b.reads == r.reads && b.seconds > 0) {
+				base = b.ops / b.seconds;
+				break;
+			}
+		}
+		double ns = r.ops ? r.seconds * 1e9 / r.ops : 0;
+		double scaling = base > 0 ? rate / base : 0;
+		if (r.reads >= 0) {
+			fprintf(stderr, "%-7s %-24s %2u threads %3d%% reads %9.1f ns/op %12.0f ops/s x%.2f\n",
+				r.suite.c_str(), r.impl.c_str(), r.threads, r.reads, ns, rate, scaling);
+		}
+		else {
+			fprintf(stderr, "%-7s %-24s %2u threads           %9.1f ns/op %12.0f ops/s x%.2f\n",
+				r.suite.c_str(), r.impl.c_str(), r.threads, ns, rate, scaling);
+		}
+		fprintf(options.out, "%s{\"suite\":\"%s\",\"impl\":\"%s\",\"threads\":%u,\"reads\":%d,\"ops\":%llu,\"seconds\":%.6f,"
+			"\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f,\"scaling\":%.3f}",
+			printed ? ",\n" : "", r.suite.c_str(), r.impl.c_str(), r.threads, r.reads, (unsigned long long)r.ops, r.seconds,
+			ns, rate, scaling);
+		fflush(options.out);
+	};
+	if (all || options.suite == "queue") {
+		queues(options, report);
+	}
+	if (all || options.suite == "lock") {
+		locks(options, report);
+	}
+	if (all || options.suite == "rwlock") {
+		rwlocks(options, report);
+	}
+	if (all || options.suite == "pool") {
+		pools(options, report);
+	}
+	fprintf(options.out, "\n]}\n");
+	if (options.out != stdout) {
+		fclose(options.out);
+	}
+	return 0;
+}
@@ -0,0 +1,89 @@
+//contention benchmark for the spin_lock family against std::mutex.
+//every thread takes the lock, bumps a shared counter and touches a few cache lines of
+//shared state, then does some private work before the next round.
+//	g++ -std=c++11 -O2 -pthread -I.. spin_lock_bench.cpp -o spin_lock_bench
+//	spin_lock_bench [threads] [milliseconds] [critical section lines]
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include "spin_lock.h"
+
+namespace {
+	struct Shared {
+		uint64_t counter;
+		uint64_t lines[64][8];
+	};
+
+	template<typename Lock>
+	void run(const char* name, unsigned threads, unsigned ms, unsigned lines) {
+		Lock lock;
+		Shared shared = {};
+		std::atomic<bool> start(false), stop(false);
+		std::vector<uint64_t> counts(threads, 0);
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; t++) {
+			workers.emplace_back([&, t]() {
+				uint64_t n = 0;
+				volatile uint64_t local = 0;
+				while (!start.load(std::memory_order_acquire)) {
+					std::this_thread::yield();
+				}
+				while (!stop.load(std::memory_order_relaxed)) {
+					{
+						std::lock_guard<Lock> lck(lock);
+						shared.counter++;
+						for (unsigned i = 0; i < lines; i++) {
+							shared.lines[i][0]++;
+						}
+					}
+					for (int i = 0; i < 32; i++) {
+						local = local + i;
+					}
+					n++;
+				}
+				counts[t] = n;
+			});
+		}
+		auto begin = std::chrono::steady_clock::now();
+		start.store(true, std::memory_order_release);
+		std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+		stop.store(true);
+		for (auto& w : workers) {
+			w.join();
+		}
+		double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+		uint64_t total = 0;
+		for (auto c : counts) {
+			total += c;
+		}
+		uint64_t lo = *std::min_element(counts.begin(), counts.end());
+		uint64_t hi = *std::max_element(counts.begin(), counts.end());
+		if (total != shared.counter) {
+			printf("%-12s LOST UPDATES %llu != %llu\n", name, (unsigned long long)total, (unsigned long long)shared.counter);
+			exit(1);
+		}
+		printf("%-12s %2u threads %10.1f ns/acquire %12.0f acquires/s  fairness min/max %.2f\n",
+			name, threads, elapsed / (total ? total : 1), total * 1e9 / elapsed, hi ? double(lo) / hi : 0.0);
+	}
+}
+
+int main(int argc, char** argv) {
+	unsigned maxThreads = argc > 1 ? unsigned(atoi(argv[1])) : std::max(2u, std::thread::hardware_concurrency());
+	unsigned ms = argc > 2 ? unsigned(atoi(argv[2])) : 500;
+	unsigned lines = argc > 3 ? std::min(64u, unsigned(atoi(argv[3]))) : 4;
+	for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+		run<std::mutex>("std::mutex", threads, ms, lines);
+		run<spin_lock>("spin_lock", threads, ms, lines);
+		run<ticket_lock>("ticket_lock", threads, ms, lines);
+		run<mcs_lock>("mcs_lock", threads, ms, lines);
+		if (threads < maxThreads && threads * 2 > maxThreads) {
+			threads = maxThreads / 2;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include "design_pattern.h"
+#include "mpsc_queue.h"
+#include "spin_lock.h"
+
+//big-reader lock for read-mostly data: every thread gets its own reader counter on its
+//own cache line, so readers on different cores never write the same line. A writer
+//raises its flag and then waits for every counter to drain, readers arriving meanwhile
+//step back until it is done (writers win). Writers are expected to be rare, they scan
+//all SLOTS counters. Drop-in for shared_mutex with shared_lock and std::lock_guard.
+//not recursive: a thread holding it shared must not take it again while a writer waits.
+class br_shared_mutex : public noncopyable {
+	enum { SLOTS = 64 };
+	struct Slot {
+		Slot() : readers(0) {}
+		std::atomic<int> readers;
+		char pad[detail::CACHE_LINE_SIZE - sizeof(std::atomic<int>)];
+	};
+public:
+	br_shared_mutex() : m_writer(false) {}
+	void lock() {
+		detail::spin_backoff backoff;
+		bool expected = false;
+		while (!m_writer.compare_exchange_weak(expected, true)) {
+			expected = false;
+			backoff.pause();
+		}
+		//pairs with the increment in lock_shared, one of us sees the other.
+		for (size_t i = 0; i < SLOTS; i++) {
+			detail::spin_backoff drain;
+			while (m_slots[i].readers.load() != 0) {
+				drain.pause();
+			}
+		}
+	}
+	bool try_lock() {
+		bool expected = false;
+		if (!m_writer.compare_exchange_strong(expected, true)) {
+			return false;
+		}
+		for (size_t i = 0; i < SLOTS; i++) {
+			if (m_slots[i].readers.load() != 0) {
+				m_writer.store(false, std::memory_order_release);
+				return false;
+			}
+		}
+		return true;
+	}
+	void unlock() {
+		m_writer.store(false, std::memory_order_release);
+	}
+	void lock_shared() {
+		std::atomic<int>& readers = slot();
+		for (;;) {
+			readers.fetch_add(1);
+			if (!m_writer.load()) {
+				return;
+			}
+			readers.fetch_sub(1, std::memory_order_release);
+			detail::spin_backoff backoff;
+			while (m_writer.load(std::memory_order_relaxed)) {
+				backoff.pause();
+			}
+		}
+	}
+	bool try_lock_shared() {
+		std::atomic<int>& readers = slot();
+		readers.fetch_add(1);
+		if (!m_writer.load()) {
+			return true;
+		}
+		readers.fetch_sub(1, std::memory_order_release);
+		return false;
+	}
+	void unlock_shared() {
+		slot().fetch_sub(1, std::memory_order_release);
+	}
+private:
+	//fixed per thread, so unlock_shared finds the counter lock_shared used.
+	std::atomic<int>& slot() {
+		return m_slots[threadIndex() % SLOTS].readers;
+	}
+	static size_t threadIndex() {
+		static std::atomic<size_t> next(0);
+		static thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed);
+		return index;
+	}
+	Slot m_slots[SLOTS];
+	std::atomic<bool> m_writer;
+};
@@ -0,0 +1,253 @@
+#pragma once
+#include "actor.h"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#include <deque>
+#include <exception>
+
+//return type of CoroutineActor::run. The body starts on the pool once the actor is registered.
+class ActorTask : public noncopyable {
+public:
+	struct promise_type {
+		ActorTask get_return_object() {
+			return ActorTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+		std::suspend_always final_suspend() noexcept {
+			return {};
+		}
+		void return_void() {}
+		void unhandled_exception() {
+			error = std::current_exception();
+		}
+		std::exception_ptr error;
+	};
+	ActorTask() {}
+	ActorTask(ActorTask&& rhs) : m_handle(rhs.m_handle) {
+		rhs.m_handle = nullptr;
+	}
+	ActorTask& operator=(ActorTask&& rhs) {
+		if (this != &rhs) {
+			if (m_handle) {
+				m_handle.destroy();
+			}
+			m_handle = rhs.m_handle;
+			rhs.m_handle = nullptr;
+		}
+		return *this;
+	}
+	~ActorTask() {
+		if (m_handle) {
+			m_handle.destroy();
+		}
+	}
+	std::coroutine_handle<> handle() const {
+		return m_handle;
+	}
+	bool done() const {
+		return !m_handle || m_handle.done();
+	}
+	//what escaped the body, null while it runs or after it returned.
+	std::exception_ptr error() const {
+		return m_handle ? m_handle.promise().error : std::exception_ptr();
+	}
+private:
+	explicit ActorTask(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+//what co_await ask(...) gives back.
+template<typename MessageType>
+struct AskResult {
+	SEND_MESSAGE_RESULT status;
+	std::unique_ptr<MessageType> reply;
+};
+
+//actor whose body is one coroutine running on the ActorManager pool:
+//	ActorTask run() override {
+//		for (;;) {
+//			auto m = co_await receive();
+//			auto r = co_await ask("db", "get", new std::string(*m->msg), std::chrono::milliseconds(100));
+//			reply(*m, r.reply.release());
+//		}
+//	}
+//while suspended it holds no pool thread and costs no pool time, it is only put back on
+//the run queue by a message, a reply or a timer. Messages that arrive while the body is
+//waiting for something else are kept in order until the next receive().
+//the body stops when it returns or at the first exception that escapes it, which is
+//logged and kept in error(). The ask it was handling, the asks still waiting for
+//receive() and the ones sent afterwards complete with E_SMR_CLOSED, other messages are
+//dropped.
+template<typename ActorIdType = std::string, typename MessageIdType = std::string, typename MessageType = std::string>
+class CoroutineActor : public ActorNoThread<ActorIdType, MessageIdType, MessageType>
+{
+	typedef ActorNoThread<ActorIdType, MessageIdType, MessageType> Base;
+public:
+	typedef typename MessageSpan<ActorIdType, MessageIdType, MessageType>::value_type Envelope;
+	CoroutineActor() : m_started(false), m_receiving(false), m_current(0), m_resumable(false) {}
+	virtual ActorTask run() = 0;
+	//pool side only, see ActorTask::error.
+	std::exception_ptr error() const {
+		return m_task.error();
+	}
+protected:
+	class ReceiveAwaiter {
+	public:
+		explicit ReceiveAwaiter(CoroutineActor* self) : m_self(self) {}
+		bool await_ready() const {
+			return !m_self->m_inbox.empty();
+		}
+		void await_suspend(std::coroutine_handle<>) {
+			m_self->m_receiving = true;
+		}
+		std::unique_ptr<Envelope> await_resume() {
+			std::unique_ptr<Envelope> msg(std::move(m_self->m_inbox.front()));
+			m_self->m_inbox.pop_front();
+			m_self->m_current = msg->replyToken;
+			return msg;
+		}
+	private:
+		CoroutineActor* m_self;
+	};
+	class AskAwaiter {
+	public:
+		AskAwaiter(CoroutineActor* self, AskFuture<MessageType>&& future) : m_self(self), m_future(std::move(future)) {
+			m_result.status = E_SMR_OK;
+		}
+		bool await_ready() const {
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<>) {
+			std::weak_ptr<void> life = m_self->lifetime();
+			//runs on the replying thread or the timer thread, we resume on the pool.
+			m_future.then([this, life](SEND_MESSAGE_RESULT status, std::unique_ptr<MessageType> reply) {
+				std::shared_ptr<void> pin = life.lock();
+				if (pin) {
+					m_result.status = status;
+					m_result.reply = std::move(reply);
+					m_self->resumeLater();
+				}
+			});
+		}
+		AskResult<MessageType> await_resume() {
+			return std::move(m_result);
+		}
+	private:
+		CoroutineActor* m_self;
+		AskFuture<MessageType> m_future;
+		AskResult<MessageType> m_result;
+	};
+	class SleepAwaiter {
+	public:
+		SleepAwaiter(CoroutineActor* self, std::chrono::milliseconds delay) : m_self(self), m_delay(delay) {}
+		bool await_ready() const {
+			return m_delay.count() <= 0;
+		}
+		void await_suspend(std::coroutine_handle<>) {
+			std::weak_ptr<void> life = m_self->lifetime();
+			CoroutineActor* self = m_self;
+			self->manager()->callAfter(m_delay, [self, life]() {
+				std::shared_ptr<void> pin = life.lock();
+				if (pin) {
+					self->resumeLater();
+				}
+			});
+		}
+		void await_resume() {}
+	private:
+		CoroutineActor* m_self;
+		std::chrono::milliseconds m_delay;
+	};
+	//the next message, in arrival order.
+	ReceiveAwaiter receive() {
+		return ReceiveAwaiter(this);
+	}
+	AskAwaiter ask(const ActorIdType& targetName, const MessageIdType& messageName, MessageType* msg, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero(), MESSAGE_PRIORITY priority = E_MP_NORMAL) {
+		return AskAwaiter(this, Base::ask(targetName, messageName, msg, timeout, priority));
+	}
+	SleepAwaiter sleep(std::chrono::milliseconds delay) {
+		return SleepAwaiter(this, delay);
+	}
+	void onEnter() override {
+		m_task = run();
+		this->wake();
+	}
+	void onWake() override {
+		if (!m_started) {
+			m_started = true;
+			resume();
+		}
+		if (m_resumable.exchange(false, std::memory_order_acquire)) {
+			resume();
+		}
+	}
+	void onMessage(const ActorIdType&, const MessageIdType&, const MessageType&) final {}
+	void onMessageBatch(const MessageSpan<ActorIdType, MessageIdType, MessageType>& batch) final {
+		if (m_task.done()) {
+			for (size_t i = 0; i < batch.size(); i++) {
+				this->manager()->refuse(batch[i], E_SMR_CLOSED);
+			}
+			return;
+		}
+		for (size_t i = 0; i < batch.size(); i++) {
+			m_inbox.push_back(batch.take(i));
+		}
+		if (m_receiving && !m_inbox.empty()) {
+			m_receiving = false;
+			resume();
+		}
+	}
+private:
+	void resume() {
+		if (!m_task.done()) {
+			m_task.handle().resume();
+			if (m_task.done()) {
+				bodyFinished();
+			}
+		}
+	}
+	//the body returned or threw: say why and answer the asks it left behind.
+	void bodyFinished() {
+#ifdef LOG4CPP_CATEGORY_NAME
+		if (std::exception_ptr error = m_task.error()) {
+			std::ostringstream ss;
+			ss << "actor:" << this->id();
+			std::string name = ss.str();
+			try {
+				std::rethrow_exception(error);
+			}
+			catch (const std::exception& e) {
+				log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("CoroutineActor[%s] body got exception[%s].", name.c_str(), e.what());
+			}
+			catch (...) {
+				log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("CoroutineActor[%s] body got exception[unknown].", name.c_str());
+			}
+		}
+#endif
+		//a no-op if the body answered it.
+		this->manager()->refuse(m_current, E_SMR_CLOSED);
+		for (auto it = m_inbox.begin(); it != m_inbox.end(); ++it) {
+			this->manager()->refuse(**it, E_SMR_CLOSED);
+		}
+		m_inbox.clear();
+		m_receiving = false;
+	}
+	//from any thread, the body continues on the pool.
+	void resumeLater() {
+		m_resumable.store(true, std::memory_order_release);
+		this->wake();
+	}
+	ActorTask m_task;
+	//pool side only.
+	bool m_started;
+	bool m_receiving;
+	std::deque<std::unique_ptr<Envelope>> m_inbox;
+	//replyToken of what receive() handed out last.
+	uint64_t m_current;
+	std::atomic<bool> m_resumable;
+};
+
+#endif
@@ -4,6 +4,8 @@
 #include <atomic>
 #include <memory>
 #endif
+#include <new>
+#include <cstdint>
 #include <map>
 #include <deque>
 #include <functional>
@@ -194,78 +196,305 @@ private:
 
 
 
+namespace detail {
+	//lock-free intrusive stack, Node needs a std::atomic<Node*> link. The top packs a
+	//counter next to the pointer that every push and pop bumps, so a node popped and pushed
+	//back while another thread was looking at it fails that thread's CAS (ABA).
+	//pop reads the link of a node another thread may have just taken, so nodes must stay
+	//mapped while the stack is in use. The pools never give memory back before that.
+	template<typename Node>
+	class tagged_stack : public noncopyable {
+		//user space addresses fit in 48 bits on x86-64 and arm64.
+		static const unsigned int POINTER_BITS = sizeof(void*) == 8 ? 48 : 32;
+	public:
+		tagged_stack() : m_top(0) {}
+		void push(Node* node) {
+			uint64_t top = m_top.load(std::memory_order_relaxed);
+			do {
+				node->link.store(pointer(top), std::memory_order_relaxed);
+			} while (!m_top.compare_exchange_weak(top, pack(node, top), std::memory_order_release, std::memory_order_relaxed));
+		}
+		Node* pop() {
+			uint64_t top = m_top.load(std::memory_order_acquire);
+			while (Node* node = pointer(top)) {
+				Node* next = node->link.load(std::memory_order_relaxed);
+				if (m_top.compare_exchange_weak(top, pack(next, top), std::memory_order_acquire, std::memory_order_acquire)) {
+					return node;
+				}
+			}
+			return nullptr;
+		}
+	private:
+		static uint64_t mask() {
+			return (uint64_t(1) << POINTER_BITS) - 1;
+		}
+		static Node* pointer(uint64_t top) {
+			return reinterpret_cast<Node*>(static_cast<uintptr_t>(top & mask()));
+		}
+		//node, with the counter of top plus one.
+		static uint64_t pack(Node* node, uint64_t top) {
+			return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(node)) | ((top & ~mask()) + (uint64_t(1) << POINTER_BITS));
+		}
+		std::atomic<uint64_t> m_top;
+	};
+}
+
+//pool of constructed objects, taken and given back without a lock. Every thread keeps a
+//magazine of free objects per pool and trades whole batches with a lock-free depot, so
+//alloc and free touch shared memory once per batch. free() calls T::reset().
+//when empty, alloc() returns nullptr and get() throws std::bad_alloc, unless setGrowth()
+//lets the pool construct more objects a chunk at a time.
+//a thread holds up to two batches of free objects, so a fixed size pool can look empty
+//to one thread while another sits on a few. Every object has to be back before the pool
+//is destroyed, and it has to outlive what get() handed out.
+//LockType is not used any more, it only keeps older declarations compiling.
 template<typename T, typename LockType = void, typename = typename std::enable_if<has_reset<T>::type::value>::type>
 class ObjectPool : noncopyable {
+	enum { BATCH = 32, ENTRIES = 8 };
+	struct Slot {
+		//the object comes first, so T* and Slot* convert into each other.
+		typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+		//next free object of a magazine or batch.
+		Slot* next;
+		//the next batch in the depot and the size of this one, first object of a batch only.
+		std::atomic<Slot*> link;
+		size_t count;
+	};
+	struct Chunk {
+		Chunk* next;
+		Slot* slots;
+		size_t count;
+	};
+	//what the pool owns. Magazines only hold a weak_ptr to it: a thread that exits returns
+	//its magazine if the pool is still there, and forgets it otherwise.
+	class Core : noncopyable {
+	public:
+		Core(std::function<void(void*)>&& construct)
+			: id(nextId()), batch(1), growth(0), limit(0), m_construct(std::move(construct)), m_objects(0), m_chunks(nullptr) {}
+		~Core() {
+			Chunk* chunk = m_chunks.load();
+			while (chunk) {
+				Chunk* next = chunk->next;
+				destroy(chunk->slots, chunk->count);
+				delete chunk;
+				chunk = next;
+			}
+		}
+		//construct n reserved objects, keep the first batch for the caller and put the rest
+		//in the depot.
+		Slot* grow(size_t n) {
+			if (n == 0) {
+				return nullptr;
+			}
+			std::unique_ptr<Chunk> chunk;
+			size_t built = 0;
+			try {
+				chunk.reset(new Chunk());
+				chunk->slots = new Slot[n];
+				chunk->count = n;
+				for (; built < n; built++) {
+					m_construct(&chunk->slots[built].storage);
+				}
+			}
+			catch (...) {
+				if (chunk && chunk->count == n) {
+					destroy(chunk->slots, built);
+				}
+				m_objects.fetch_sub(n, std::memory_order_relaxed);
+				throw;
+			}
+			Chunk* top = m_chunks.load(std::memory_order_relaxed);
+			do {
+				chunk->next = top;
+			} while (!m_chunks.compare_exchange_weak(top, chunk.get(), std::memory_order_release, std::memory_order_relaxed));
+			Slot* slots = chunk.release()->slots;
+			Slot* first = nullptr;
+			for (size_t i = 0; i < n; i += batch) {
+				size_t count = n - i < batch ? n - i : batch;
+				for (size_t j = 0; j + 1 < count; j++) {
+					slots[i + j].next = &slots[i + j + 1];
+				}
+				slots[i + count - 1].next = nullptr;
+				slots[i].count = count;
+				if (first == nullptr) {
+					first = &slots[i];
+				}
+				else {
+					depot.push(&slots[i]);
+				}
+			}
+			return first;
+		}
+		//count n more objects against limit, returns how many fit.
+		size_t reserve(size_t n) {
+			size_t objects = m_objects.load(std::memory_order_relaxed);
+			size_t granted;
+			do {
+				granted = limit == 0 || objects + n <= limit ? n : (objects < limit ? limit - objects : 0);
+			} while (granted != 0 && !m_objects.compare_exchange_weak(objects, objects + granted, std::memory_order_relaxed));
+			return granted;
+		}
+		size_t objects() const {
+			return m_objects.load(std::memory_order_relaxed);
+		}
+		const uint64_t id;
+		//objects per batch, and per chunk when growing, 0 for a fixed size pool.
+		size_t batch;
+		size_t growth;
+		size_t limit;
+		detail::tagged_stack<Slot> depot;
+	private:
+		static uint64_t nextId() {
+			static std::atomic<uint64_t> next(1);
+			return next.fetch_add(1, std::memory_order_relaxed);
+		}
+		static void destroy(Slot* slots, size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				reinterpret_cast<T*>(&slots[i].storage)->~T();
+			}
+			delete[] slots;
+		}
+		std::function<void(void*)> m_construct;
+		std::atomic<size_t> m_objects;
+		std::atomic<Chunk*> m_chunks;
+	};
+	//this thread's free objects of one pool.
+	struct Magazine {
+		Magazine() : id(0), head(nullptr), count(0) {}
+		uint64_t id;
+		std::weak_ptr<Core> owner;
+		Slot* head;
+		size_t count;
+	};
+	//a few pools of the same T per thread, by pool id. Pools that collide take turns.
+	struct Magazines {
+		~Magazines() {
+			for (size_t i = 0; i < ENTRIES; i++) {
+				flush(entries[i]);
+			}
+		}
+		Magazine entries[ENTRIES];
+	};
 public:
+	struct Deleter {
+		ObjectPool* pool;
+		void operator()(T* ptr) const {
+			pool->free(ptr);
+		}
+	};
+	typedef std::unique_ptr<T, Deleter> unique_ptr;
+
+	//num objects up front, every one constructed from args.
 	template<typename ...Args>
-	ObjectPool(size_t num, Args&&... args) {
-		while(num--) {
-			_objs.emplace_back(new T(std::forward <Args&&>(args)...));
+	ObjectPool(size_t num, Args&&... args)
+		: m_core(std::make_shared<Core>([args...](void* p) { new (p) T(args...); }))
+	{
+		m_core->batch = batchFor(num);
+		if (Slot* first = m_core->grow(m_core->reserve(num))) {
+			m_core->depot.push(first);
+		}
+	}
+	//construct chunk more objects whenever the pool runs dry, up to limit in total
+	//(0 for no limit). Call it before the pool is shared with other threads.
+	void setGrowth(size_t chunk, size_t limit = 0) {
+		m_core->growth = chunk;
+		m_core->limit = limit;
+		if (chunk != 0) {
+			m_core->batch = batchFor(chunk * 8);
 		}
 	}
 	std::shared_ptr<T> get() {
-		std::lock_guard<LockType> _(_lock);
-		if (_objs.empty()) {
+		T* p = alloc();
+		if (p == nullptr) {
 			throw(std::bad_alloc());
 		}
-		auto p = std::shared_ptr<T>(_objs.front(), [&](T* ptr)
-		{
-			_free(ptr);
-		});
-		_objs.pop_front();
-		return p;
+		Deleter deleter = { this };
+		return std::shared_ptr<T>(p, deleter);
+	}
+	//a null unique_ptr when empty.
+	unique_ptr getUnique() noexcept {
+		Deleter deleter = { this };
+		return unique_ptr(alloc(), deleter);
 	}
 	T* alloc() noexcept {
-		std::lock_guard<LockType> _(_lock);
-		if (_objs.empty()) {
+		Magazine& m = magazine();
+		if (m.head == nullptr && !refill(m)) {
 			return nullptr;
 		}
-		auto p = _objs.front();
-		_objs.pop_front();
-		return p;
+		Slot* slot = m.head;
+		m.head = slot->next;
+		--m.count;
+		return reinterpret_cast<T*>(&slot->storage);
 	}
 	void free(T* ptr) noexcept {
-		std::lock_guard<LockType> _(_lock);
-		_objs.emplace_back(ptr);
+		ptr->reset();
+		Slot* slot = reinterpret_cast<Slot*>(ptr);
+		Magazine& m = magazine();
+		slot->next = m.head;
+		m.head = slot;
+		if (++m.count >= m_core->batch * 2) {
+			//keep the batch freed last, it is still in cache, and pass on the rest.
+			Slot* last = m.head;
+			for (size_t i = 1; i < m_core->batch; i++) {
+				last = last->next;
+			}
+			Slot* rest = last->next;
+			last->next = nullptr;
+			rest->count = m.count - m_core->batch;
+			m.count = m_core->batch;
+			m_core->depot.push(rest);
+		}
+	}
+	//objects constructed so far, free or not.
+	size_t objects() const {
+		return m_core->objects();
 	}
 private:
-	std::deque<T*> _objs;
-	LockType _lock;
-};
-
-template<typename T>
-class ObjectPool<T, void, typename std::enable_if<has_reset<T>::type::value>::type> : noncopyable {
-public:
-	template<typename ...Args>
-	ObjectPool(size_t num, Args&&... args) {
-		while(num--) {
-			_objs.emplace_back(new T(std::forward<Args&&>(args)...));
-		}
+	static size_t batchFor(size_t objects) {
+		size_t batch = objects / 8;
+		return batch == 0 ? 1 : (batch > static_cast<size_t>(BATCH) ? static_cast<size_t>(BATCH) : batch);
 	}
-	std::shared_ptr<T> get() {
-		if (_objs.empty()) {
-			throw(std::bad_alloc());
+	bool refill(Magazine& m) noexcept {
+		Slot* batch = m_core->depot.pop();
+		if (batch == nullptr) {
+			try {
+				batch = m_core->growth == 0 ? nullptr : m_core->grow(m_core->reserve(m_core->growth));
+			}
+			catch (...) {
+				return false;
+			}
+			if (batch == nullptr) {
+				return false;
+			}
 		}
-		auto p = std::shared_ptr<T>(_objs.front(), [&](T* ptr)
-		{
-			_free(ptr);
-		});
-		_objs.pop_front();
-		return p;
+		m.head = batch;
+		m.count = batch->count;
+		return true;
 	}
-	T* alloc() noexcept {
-		if (_objs.empty()) {
-			return nullptr;
+	Magazine& magazine() {
+		static thread_local Magazines magazines;
+		Magazine& m = magazines.entries[m_core->id % ENTRIES];
+		if (m.id != m_core->id) {
+			flush(m);
+			m.id = m_core->id;
+			m.owner = m_core;
 		}
-		auto p = _objs.front();
-		_objs.pop_front();
-		return p;
+		return m;
 	}
-	void free(T* ptr) noexcept {
-		_objs.emplace_back(ptr);
+	//hand a magazine back to its pool, if that still exists.
+	static void flush(Magazine& m) {
+		if (m.head) {
+			if (std::shared_ptr<Core> core = m.owner.lock()) {
+				m.head->count = m.count;
+				core->depot.push(m.head);
+			}
+		}
+		m.id = 0;
+		m.owner.reset();
+		m.head = nullptr;
+		m.count = 0;
 	}
-private:
-	std::deque<T*> _objs;
+	std::shared_ptr<Core> m_core;
 };
 
 #endif
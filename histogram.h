@@ -0,0 +1,178 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace detail {
+	//index of the highest set bit, v != 0.
+	inline unsigned int highest_bit(uint64_t v) {
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanReverse64(&index, v);
+		return index;
+#elif defined(_MSC_VER)
+		unsigned long index;
+		if (_BitScanReverse(&index, static_cast<unsigned long>(v >> 32))) {
+			return index + 32;
+		}
+		_BitScanReverse(&index, static_cast<unsigned long>(v));
+		return index;
+#else
+		return 63 - __builtin_clzll(v);
+#endif
+	}
+}
+
+//log-linear histogram in the HDR style: every power of two is split into 16 linear
+//buckets, so any recorded value is known to within 1/16 of itself, from 0 up to 2^40
+//(about 18 minutes in nanoseconds, larger values count as 2^40). Recording is a few
+//shifts and relaxed stores, no lock and no allocation.
+//one writer at a time, any thread may read or copy it meanwhile and sees every counter
+//at some recent value. Give every writer its own and merge() them for a total.
+class histogram {
+public:
+	enum {
+		SUB_BITS = 4,
+		SUB_COUNT = 1 << SUB_BITS,
+		MAX_BITS = 40,
+		BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT
+	};
+	histogram() {
+		reset();
+	}
+	histogram(const histogram& rhs) {
+		copy(rhs);
+	}
+	histogram& operator=(const histogram& rhs) {
+		if (this != &rhs) {
+			copy(rhs);
+		}
+		return *this;
+	}
+	void record(uint64_t value, uint64_t count = 1) {
+		if (count == 0) {
+			return;
+		}
+		if (value >= (uint64_t(1) << MAX_BITS)) {
+			value = (uint64_t(1) << MAX_BITS) - 1;
+		}
+		bump(m_buckets[bucket(value)], count);
+		bump(m_count, count);
+		bump(m_sum, value * count);
+		if (value < m_min.load(std::memory_order_relaxed)) {
+			m_min.store(value, std::memory_order_relaxed);
+		}
+		if (value > m_max.load(std::memory_order_relaxed)) {
+			m_max.store(value, std::memory_order_relaxed);
+		}
+	}
+	//add what other recorded, other's writer may keep going.
+	void merge(const histogram& other) {
+		for (size_t i = 0; i < BUCKETS; i++) {
+			bump(m_buckets[i], other.m_buckets[i].load(std::memory_order_relaxed));
+		}
+		bump(m_count, other.m_count.load(std::memory_order_relaxed));
+		bump(m_sum, other.m_sum.load(std::memory_order_relaxed));
+		if (other.minimum() < m_min.load(std::memory_order_relaxed)) {
+			m_min.store(other.minimum(), std::memory_order_relaxed);
+		}
+		if (other.maximum() > m_max.load(std::memory_order_relaxed)) {
+			m_max.store(other.maximum(), std::memory_order_relaxed);
+		}
+	}
+	//writer side only.
+	void reset() {
+		for (size_t i = 0; i < BUCKETS; i++) {
+			m_buckets[i].store(0, std::memory_order_relaxed);
+		}
+		m_count.store(0, std::memory_order_relaxed);
+		m_sum.store(0, std::memory_order_relaxed);
+		m_min.store(UINT64_MAX, std::memory_order_relaxed);
+		m_max.store(0, std::memory_order_relaxed);
+	}
+	uint64_t count() const {
+		return m_count.load(std::memory_order_relaxed);
+	}
+	uint64_t minimum() const {
+		uint64_t v = m_min.load(std::memory_order_relaxed);
+		return v == UINT64_MAX ? 0 : v;
+	}
+	uint64_t maximum() const {
+		return m_max.load(std::memory_order_relaxed);
+	}
+	double mean() const {
+		uint64_t n = count();
+		return n == 0 ? 0.0 : static_cast<double>(m_sum.load(std::memory_order_relaxed)) / n;
+	}
+	//the smallest value at least p (0..1) of the recorded ones are not above,
+	//rounded up to the end of its bucket. 0 when empty.
+	uint64_t percentile(double p) const {
+		uint64_t total = 0;
+		for (size_t i = 0; i < BUCKETS; i++) {
+			total += m_buckets[i].load(std::memory_order_relaxed);
+		}
+		if (total == 0) {
+			return 0;
+		}
+		uint64_t rank = static_cast<uint64_t>(p * total + 0.5);
+		rank = rank == 0 ? 1 : (rank > total ? total : rank);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BUCKETS; i++) {
+			seen += m_buckets[i].load(std::memory_order_relaxed);
+			if (seen >= rank) {
+				uint64_t top = upperBound(i);
+				uint64_t highest = maximum();
+				return highest != 0 && top > highest ? highest : top;
+			}
+		}
+		return maximum();
+	}
+	//the range of values that land in bucket i.
+	static uint64_t lowerBound(size_t i) {
+		if (i < SUB_COUNT) {
+			return i;
+		}
+		unsigned int shift = static_cast<unsigned int>(i / SUB_COUNT) - 1;
+		return (SUB_COUNT + i % SUB_COUNT) << shift;
+	}
+	static uint64_t upperBound(size_t i) {
+		if (i < SUB_COUNT) {
+			return i;
+		}
+		unsigned int shift = static_cast<unsigned int>(i / SUB_COUNT) - 1;
+		return lowerBound(i) + (uint64_t(1) << shift) - 1;
+	}
+	static size_t bucket(uint64_t value) {
+		if (value < SUB_COUNT) {
+			return static_cast<size_t>(value);
+		}
+		unsigned int shift = detail::highest_bit(value) - SUB_BITS;
+		return static_cast<size_t>((shift + 1) * SUB_COUNT + ((value >> shift) & (SUB_COUNT - 1)));
+	}
+	uint64_t bucketCount(size_t i) const {
+		return m_buckets[i].load(std::memory_order_relaxed);
+	}
+private:
+	//single writer: a plain add, no locked instruction.
+	static void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	void copy(const histogram& rhs) {
+		for (size_t i = 0; i < BUCKETS; i++) {
+			m_buckets[i].store(rhs.m_buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+		m_count.store(rhs.m_count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		m_sum.store(rhs.m_sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		m_min.store(rhs.m_min.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		m_max.store(rhs.m_max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	std::atomic<uint64_t> m_buckets[BUCKETS];
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum;
+	std::atomic<uint64_t> m_min;
+	std::atomic<uint64_t> m_max;
+};
@@ -0,0 +1,600 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include "mq.h"
+#include "mpsc_queue.h"
+#include "mpmc_ring.h"
+#include "wait_strategy.h"
+
+enum MAILBOX_TYPE
+{
+	E_MBT_MPSC,
+	E_MBT_LOCKED,
+	//preallocated ring, overhead is a hard limit enforced by policy.
+	E_MBT_BOUNDED
+};
+
+//what a full E_MBT_BOUNDED mailbox does with a new message.
+enum BACKPRESSURE_POLICY
+{
+	//not enqueued, E_SMR_REJECTED.
+	E_BP_REJECT,
+	//the sender waits up to blockTimeout for room, then E_SMR_TIMEOUT.
+	E_BP_BLOCK,
+	//the oldest pending message is discarded to make room, E_SMR_OVERHEAD. The mailbox's
+	//drop handler sees the discarded one first.
+	E_BP_DROP_OLDEST,
+	//the new message is discarded, E_SMR_DROPPED.
+	E_BP_DROP_NEWEST
+};
+
+struct MailboxOptions
+{
+	MailboxOptions(size_t overhead_ = 1024, MAILBOX_TYPE type_ = E_MBT_MPSC, size_t batch_ = 64)
+		: overhead(overhead_), type(type_), batch(batch_ == 0 ? 1 : batch_), policy(E_BP_REJECT), blockTimeout(0)
+	{}
+	static MailboxOptions bounded(size_t capacity, BACKPRESSURE_POLICY policy, unsigned int blockTimeoutMs = 0) {
+		MailboxOptions options(capacity, E_MBT_BOUNDED);
+		options.policy = policy;
+		options.blockTimeout = blockTimeoutMs;
+		return options;
+	}
+	//0 means no limit, only advisory: push still succeed and return E_SMR_OVERHEAD.
+	//for E_MBT_BOUNDED the ring capacity, rounded up to a power of two.
+	size_t overhead;
+	MAILBOX_TYPE type;
+	//most messages handed to one onMessageBatch call.
+	size_t batch;
+	BACKPRESSURE_POLICY policy;
+	//milliseconds, E_BP_BLOCK only.
+	unsigned int blockTimeout;
+	//how the actor's own thread waits for messages, E_MBT_LOCKED always parks.
+	WaitStrategy wait;
+};
+
+//per policy counters of a bounded mailbox, all zero for the unbounded ones.
+struct MailboxStats
+{
+	MailboxStats() : rejected(0), blocked(0), timedOut(0), droppedOldest(0), droppedNewest(0) {}
+	uint64_t rejected;
+	//sends that had to wait, timedOut of them gave up.
+	uint64_t blocked;
+	uint64_t timedOut;
+	uint64_t droppedOldest;
+	uint64_t droppedNewest;
+};
+
+namespace detail {
+	//the lanes above E_MP_NORMAL, allocated on the first priority send.
+	//m_pending is all the consumer checks while only the normal lane is used.
+	template<typename T>
+	class priority_lanes : public noncopyable {
+		typedef intrusive_mpsc_queue<T> lane;
+	public:
+		priority_lanes() : m_lanes(nullptr), m_pending(0) {}
+		~priority_lanes() {
+			delete[] m_lanes.load();
+		}
+		void push(T* node) {
+			lanes()[node->priority - 1].push(node);
+			m_pending.fetch_add(1, std::memory_order_release);
+		}
+		//single consumer, highest lane first.
+		T* try_pop() {
+			if (m_pending.load(std::memory_order_acquire) == 0) {
+				return nullptr;
+			}
+			lane* l = m_lanes.load(std::memory_order_acquire);
+			for (int i = E_MP_LEVELS - 2; i >= 0; --i) {
+				if (T* node = l[i].try_pop()) {
+					m_pending.fetch_sub(1, std::memory_order_relaxed);
+					return node;
+				}
+			}
+			return nullptr;
+		}
+	private:
+		lane* lanes() {
+			lane* l = m_lanes.load(std::memory_order_acquire);
+			if (l == nullptr) {
+				lane* fresh = new lane[E_MP_LEVELS - 1];
+				if (m_lanes.compare_exchange_strong(l, fresh, std::memory_order_acq_rel)) {
+					l = fresh;
+				}
+				else {
+					delete[] fresh;
+				}
+			}
+			return l;
+		}
+		std::atomic<lane*> m_lanes;
+		std::atomic<size_t> m_pending;
+	};
+}
+
+template<typename T>
+class mailbox : public noncopyable {
+public:
+	virtual ~mailbox() {}
+	virtual SEND_MESSAGE_RESULT push(std::unique_ptr<T>&& msg) = 0;
+	//accepted messages are taken out of batch. All or nothing, except for a bounded
+	//mailbox which stops at the first refused message, leaves it and the rest in batch
+	//and returns its result.
+	virtual SEND_MESSAGE_RESULT push(std::vector<std::unique_ptr<T>>& batch) = 0;
+	//block until a message arrived or the mailbox closed and drained.
+	virtual bool pop(std::unique_ptr<T>& msg) = 0;
+	virtual bool try_pop(std::unique_ptr<T>& msg) = 0;
+	//append up to max messages to batch, pop blocks like the single message version.
+	virtual bool pop(std::vector<std::unique_ptr<T>>& batch, size_t max) = 0;
+	virtual size_t try_pop(std::vector<std::unique_ptr<T>>& batch, size_t max) = 0;
+	virtual bool empty() = 0;
+	virtual size_t size() = 0;
+	virtual void close() = 0;
+	virtual MailboxStats stats() {
+		return MailboxStats();
+	}
+	//called with every message the mailbox discards after accepting it, right before
+	//it is deleted, on the thread that caused the drop and inside its push. Set it before
+	//the mailbox is shared.
+	void onDrop(const std::function<void(T&)>& handler) {
+		m_onDrop = handler;
+	}
+protected:
+	void drop(T* msg) {
+		if (m_onDrop) {
+			m_onDrop(*msg);
+		}
+		delete msg;
+	}
+private:
+	std::function<void(T&)> m_onDrop;
+};
+
+//the original std::mutex + std::deque queue.
+template<typename T>
+class locked_mailbox : public mailbox<T> {
+public:
+	explicit locked_mailbox(size_t overhead) : m_queue(overhead) {}
+	SEND_MESSAGE_RESULT push(std::unique_ptr<T>&& msg) override {
+		unsigned int lane = msg->priority;
+		return m_queue.push(std::move(msg), lane);
+	}
+	SEND_MESSAGE_RESULT push(std::vector<std::unique_ptr<T>>& batch) override {
+		for (auto it = batch.begin(); it != batch.end(); ++it) {
+			if ((*it)->priority != E_MP_NORMAL) {
+				return pushLanes(batch);
+			}
+		}
+		return m_queue.push(batch);
+	}
+	bool pop(std::unique_ptr<T>& msg) override {
+		return m_queue.pop(msg);
+	}
+	bool try_pop(std::unique_ptr<T>& msg) override {
+		return m_queue.try_pop(msg);
+	}
+	bool pop(std::vector<std::unique_ptr<T>>& batch, size_t max) override {
+		return m_queue.pop(batch, max);
+	}
+	size_t try_pop(std::vector<std::unique_ptr<T>>& batch, size_t max) override {
+		return m_queue.try_pop(batch, max);
+	}
+	bool empty() override {
+		return m_queue.size() == 0;
+	}
+	size_t size() override {
+		return m_queue.size();
+	}
+	void close() override {
+		m_queue.close();
+	}
+private:
+	//rare: priority messages in a batch go one by one.
+	SEND_MESSAGE_RESULT pushLanes(std::vector<std::unique_ptr<T>>& batch) {
+		SEND_MESSAGE_RESULT ret = E_SMR_OK;
+		size_t n = 0;
+		for (; n < batch.size(); n++) {
+			unsigned int lane = batch[n]->priority;
+			SEND_MESSAGE_RESULT r = m_queue.push(std::move(batch[n]), lane);
+			if (r != E_SMR_OK && r != E_SMR_OVERHEAD) {
+				ret = r;
+				break;
+			}
+			if (r == E_SMR_OVERHEAD) {
+				ret = r;
+			}
+		}
+		batch.erase(batch.begin(), batch.begin() + n);
+		return ret;
+	}
+	message_queue<std::unique_ptr<T>> m_queue;
+};
+
+//lock-free for producers and consumer, the consumer only parks when the mailbox is empty,
+//and a producer only wakes it on the empty -> non-empty transition.
+template<typename T>
+class mpsc_mailbox : public mailbox<T> {
+public:
+	explicit mpsc_mailbox(size_t overhead, const WaitStrategy& wait = WaitStrategy())
+		: m_size(0), m_overhead(overhead), m_closed(false), m_wait(wait)
+	{}
+	~mpsc_mailbox() {
+		std::unique_ptr<T> msg;
+		while (m_size.load(std::memory_order_acquire) != 0) {
+			if (!try_pop(msg)) {
+				std::this_thread::yield();
+			}
+		}
+	}
+	SEND_MESSAGE_RESULT push(std::unique_ptr<T>&& msg) override {
+		if (m_closed.load(std::memory_order_acquire)) {
+			return E_SMR_CLOSED;
+		}
+		//counted before it is linked, so a consumer never takes m_size below zero.
+		size_t prev = m_size.fetch_add(1);
+		if (msg->priority != E_MP_NORMAL) {
+			m_lanes.push(msg.release());
+		}
+		else {
+			m_queue.push(msg.release());
+		}
+		if (prev == 0) {
+			m_ready.notifyOne();
+		}
+		if (m_overhead > 0 && prev + 1 > m_overhead) {
+			return E_SMR_OVERHEAD;
+		}
+		return E_SMR_OK;
+	}
+	//the batch is linked up front and spliced in with a single exchange.
+	SEND_MESSAGE_RESULT push(std::vector<std::unique_ptr<T>>& batch) override {
+		if (batch.empty()) {
+			return E_SMR_OK;
+		}
+		if (m_closed.load(std::memory_order_acquire)) {
+			return E_SMR_CLOSED;
+		}
+		size_t n = batch.size();
+		size_t prev = m_size.fetch_add(n);
+		T* first = nullptr;
+		T* last = nullptr;
+		for (auto it = batch.begin(); it != batch.end(); ++it) {
+			T* node = it->release();
+			if (node->priority != E_MP_NORMAL) {
+				m_lanes.push(node);
+				continue;
+			}
+			if (last) {
+				last->next.store(node, std::memory_order_relaxed);
+			}
+			else {
+				first = node;
+			}
+			last = node;
+		}
+		batch.clear();
+		if (first) {
+			m_queue.push(first, last);
+		}
+		if (prev == 0) {
+			m_ready.notifyOne();
+		}
+		if (m_overhead > 0 && prev + n > m_overhead) {
+			return E_SMR_OVERHEAD;
+		}
+		return E_SMR_OK;
+	}
+	bool pop(std::unique_ptr<T>& msg) override {
+		for (;;) {
+			if (try_pop(msg)) {
+				return true;
+			}
+			if (m_size.load() != 0) {
+				//a producer counted its message but has not linked it yet.
+				cpu_relax();
+				continue;
+			}
+			m_wait.waitUntil(m_ready, [this]() { return m_size.load() != 0 || m_closed.load(); });
+			if (m_size.load() == 0) {
+				return false;
+			}
+		}
+	}
+	bool try_pop(std::unique_ptr<T>& msg) override {
+		T* node = next();
+		if (node == nullptr) {
+			return false;
+		}
+		m_size.fetch_sub(1, std::memory_order_relaxed);
+		msg.reset(node);
+		return true;
+	}
+	bool pop(std::vector<std::unique_ptr<T>>& batch, size_t max) override {
+		std::unique_ptr<T> msg;
+		if (max == 0 || !pop(msg)) {
+			return false;
+		}
+		batch.push_back(std::move(msg));
+		try_pop(batch, max - 1);
+		return true;
+	}
+	//one m_size update for the whole batch.
+	size_t try_pop(std::vector<std::unique_ptr<T>>& batch, size_t max) override {
+		size_t n = 0;
+		for (; n < max; n++) {
+			T* node = next();
+			if (node == nullptr) {
+				break;
+			}
+			batch.push_back(std::unique_ptr<T>(node));
+		}
+		if (n != 0) {
+			m_size.fetch_sub(n, std::memory_order_relaxed);
+		}
+		return n;
+	}
+	bool empty() override {
+		return m_size.load() == 0;
+	}
+	size_t size() override {
+		return m_size.load();
+	}
+	void close() override {
+		m_closed.store(true);
+		m_ready.notifyAll();
+	}
+private:
+	T* next() {
+		T* node = m_lanes.try_pop();
+		return node ? node : m_queue.try_pop();
+	}
+	intrusive_mpsc_queue<T> m_queue;
+	detail::priority_lanes<T> m_lanes;
+	std::atomic<size_t> m_size;
+	size_t m_overhead;
+	std::atomic<bool> m_closed;
+	WaitStrategy m_wait;
+	//the consumer parks here, producers only notify on empty -> non-empty.
+	event_count m_ready;
+};
+
+//hard limited mailbox on a preallocated ring, a full ring is handled by the policy
+//before anything is enqueued, so memory never grows past the capacity.
+//the ring is multi-consumer, which lets E_BP_DROP_OLDEST senders evict for themselves.
+template<typename T>
+class bounded_mailbox : public mailbox<T> {
+public:
+	bounded_mailbox(size_t capacity, BACKPRESSURE_POLICY policy, unsigned int blockTimeout, const WaitStrategy& wait = WaitStrategy())
+		: m_ring(capacity == 0 ? 1 : capacity), m_policy(policy), m_blockTimeout(blockTimeout), m_size(0), m_closed(false), m_wait(wait), m_blockedSenders(0)
+		, m_rejected(0), m_blocked(0), m_timedOut(0), m_droppedOldest(0), m_droppedNewest(0)
+	{}
+	~bounded_mailbox() {
+		while (T* node = m_ring.try_pop()) {
+			delete node;
+		}
+		while (T* node = m_lanes.try_pop()) {
+			delete node;
+		}
+	}
+	SEND_MESSAGE_RESULT push(std::unique_ptr<T>&& msg) override {
+		if (m_closed.load(std::memory_order_acquire)) {
+			return E_SMR_CLOSED;
+		}
+		if (msg->priority != E_MP_NORMAL) {
+			//control traffic is never refused or dropped, it is expected to be rare.
+			size_t prev = m_size.fetch_add(1);
+			m_lanes.push(msg.release());
+			if (prev == 0) {
+				m_ready.notifyOne();
+			}
+			return E_SMR_OK;
+		}
+		if (tryPush(msg)) {
+			return E_SMR_OK;
+		}
+		switch (m_policy) {
+		case E_BP_BLOCK:
+			return pushWait(msg);
+		case E_BP_DROP_OLDEST:
+			//a consumer may take the slot first, then we just retry.
+			do {
+				if (T* oldest = m_ring.try_pop()) {
+					m_size.fetch_sub(1);
+					m_droppedOldest.fetch_add(1, std::memory_order_relaxed);
+					this->drop(oldest);
+				}
+			} while (!tryPush(msg));
+			return E_SMR_OVERHEAD;
+		case E_BP_DROP_NEWEST:
+			m_droppedNewest.fetch_add(1, std::memory_order_relaxed);
+			return E_SMR_DROPPED;
+		case E_BP_REJECT:
+		default:
+			m_rejected.fetch_add(1, std::memory_order_relaxed);
+			return E_SMR_REJECTED;
+		}
+	}
+	SEND_MESSAGE_RESULT push(std::vector<std::unique_ptr<T>>& batch) override {
+		size_t n = 0;
+		SEND_MESSAGE_RESULT ret = E_SMR_OK;
+		for (; n < batch.size(); n++) {
+			SEND_MESSAGE_RESULT r = push(std::move(batch[n]));
+			if (r != E_SMR_OK && r != E_SMR_OVERHEAD) {
+				ret = r;
+				break;
+			}
+			if (r == E_SMR_OVERHEAD) {
+				ret = r;
+			}
+		}
+		batch.erase(batch.begin(), batch.begin() + n);
+		return ret;
+	}
+	bool pop(std::unique_ptr<T>& msg) override {
+		for (;;) {
+			if (try_pop(msg)) {
+				return true;
+			}
+			m_wait.waitUntil(m_ready, [this]() { return m_size.load() != 0 || m_closed.load(); });
+			if (m_size.load() == 0) {
+				return false;
+			}
+		}
+	}
+	bool try_pop(std::unique_ptr<T>& msg) override {
+		T* node = m_lanes.try_pop();
+		if (node != nullptr) {
+			m_size.fetch_sub(1);
+			msg.reset(node);
+			return true;
+		}
+		node = m_ring.try_pop();
+		if (node == nullptr) {
+			return false;
+		}
+		m_size.fetch_sub(1);
+		popped();
+		msg.reset(node);
+		return true;
+	}
+	bool pop(std::vector<std::unique_ptr<T>>& batch, size_t max) override {
+		std::unique_ptr<T> msg;
+		if (max == 0 || !pop(msg)) {
+			return false;
+		}
+		batch.push_back(std::move(msg));
+		try_pop(batch, max - 1);
+		return true;
+	}
+	size_t try_pop(std::vector<std::unique_ptr<T>>& batch, size_t max) override {
+		size_t n = 0;
+		for (; n < max; n++) {
+			T* node = m_lanes.try_pop();
+			if (node == nullptr) {
+				node = m_ring.try_pop();
+			}
+			if (node == nullptr) {
+				break;
+			}
+			batch.push_back(std::unique_ptr<T>(node));
+		}
+		if (n != 0) {
+			m_size.fetch_sub(n);
+			popped();
+		}
+		return n;
+	}
+	bool empty() override {
+		return m_size.load() == 0;
+	}
+	size_t size() override {
+		return m_size.load();
+	}
+	void close() override {
+		m_closed.store(true);
+		m_ready.notifyAll();
+		std::lock_guard<std::mutex> lck(m_spaceMutex);
+		m_spaceCv.notify_all();
+	}
+	MailboxStats stats() override {
+		MailboxStats s;
+		s.rejected = m_rejected.load(std::memory_order_relaxed);
+		s.blocked = m_blocked.load(std::memory_order_relaxed);
+		s.timedOut = m_timedOut.load(std::memory_order_relaxed);
+		s.droppedOldest = m_droppedOldest.load(std::memory_order_relaxed);
+		s.droppedNewest = m_droppedNewest.load(std::memory_order_relaxed);
+		return s;
+	}
+private:
+	//counted before it is visible in the ring, so a consumer never takes m_size below
+	//zero, and uncounted again if the ring is full. Whoever lifts m_size off zero notifies,
+	//even when its push fails, a consumer that saw the count just finds nothing and parks.
+	bool tryPush(std::unique_ptr<T>& msg) {
+		size_t prev = m_size.fetch_add(1);
+		bool ok = m_ring.try_push(msg.get());
+		if (ok) {
+			msg.release();
+		}
+		else {
+			m_size.fetch_sub(1);
+		}
+		if (prev == 0) {
+			m_ready.notifyOne();
+		}
+		return ok;
+	}
+	//pairs with the increment in pushWait, whoever goes second sees the other.
+	void popped() {
+		if (m_policy != E_BP_BLOCK) {
+			return;
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_blockedSenders.load() != 0) {
+			{
+				std::lock_guard<std::mutex> lck(m_spaceMutex);
+			}
+			m_spaceCv.notify_all();
+		}
+	}
+	SEND_MESSAGE_RESULT pushWait(std::unique_ptr<T>& msg) {
+		m_blocked.fetch_add(1, std::memory_order_relaxed);
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_blockTimeout);
+		std::unique_lock<std::mutex> lck(m_spaceMutex);
+		m_blockedSenders.fetch_add(1);
+		for (;;) {
+			if (m_closed.load()) {
+				m_blockedSenders.fetch_sub(1);
+				return E_SMR_CLOSED;
+			}
+			if (tryPush(msg)) {
+				m_blockedSenders.fetch_sub(1);
+				return E_SMR_OK;
+			}
+			if (m_spaceCv.wait_until(lck, deadline) == std::cv_status::timeout && std::chrono::steady_clock::now() >= deadline) {
+				if (tryPush(msg)) {
+					m_blockedSenders.fetch_sub(1);
+					return E_SMR_OK;
+				}
+				m_blockedSenders.fetch_sub(1);
+				m_timedOut.fetch_add(1, std::memory_order_relaxed);
+				return E_SMR_TIMEOUT;
+			}
+		}
+	}
+	mpmc_ring<T> m_ring;
+	detail::priority_lanes<T> m_lanes;
+	BACKPRESSURE_POLICY m_policy;
+	unsigned int m_blockTimeout;
+	std::atomic<size_t> m_size;
+	std::atomic<bool> m_closed;
+	WaitStrategy m_wait;
+	event_count m_ready;
+	std::atomic<int> m_blockedSenders;
+	std::mutex m_spaceMutex;
+	std::condition_variable m_spaceCv;
+	std::atomic<uint64_t> m_rejected;
+	std::atomic<uint64_t> m_blocked;
+	std::atomic<uint64_t> m_timedOut;
+	std::atomic<uint64_t> m_droppedOldest;
+	std::atomic<uint64_t> m_droppedNewest;
+};
+
+template<typename T>
+std::unique_ptr<mailbox<T>> make_mailbox(const MailboxOptions& options) {
+	switch (options.type) {
+	case E_MBT_LOCKED:
+		return std::unique_ptr<mailbox<T>>(new locked_mailbox<T>(options.overhead));
+	case E_MBT_BOUNDED:
+		return std::unique_ptr<mailbox<T>>(new bounded_mailbox<T>(options.overhead, options.policy, options.blockTimeout, options.wait));
+	case E_MBT_MPSC:
+	default:
+		return std::unique_ptr<mailbox<T>>(new mpsc_mailbox<T>(options.overhead, options.wait));
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include "design_pattern.h"
+#include "mpsc_queue.h"
+
+//bounded multi-producer/multi-consumer ring of pointers (Vyukov).
+//all cells are allocated up front, capacity is rounded up to a power of two.
+//try_push/try_pop never block, they fail when the ring is full/empty.
+template<typename T>
+class mpmc_ring : public noncopyable {
+public:
+	explicit mpmc_ring(size_t capacity) : m_enqueuePos(0), m_dequeuePos(0) {
+		size_t cap = 2;
+		while (cap < capacity) {
+			cap <<= 1;
+		}
+		m_mask = cap - 1;
+		m_cells = new Cell[cap];
+		for (size_t i = 0; i < cap; i++) {
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+			m_cells[i].data = nullptr;
+		}
+	}
+	~mpmc_ring() {
+		delete[] m_cells;
+	}
+	size_t capacity() const {
+		return m_mask + 1;
+	}
+	bool try_push(T* item) {
+		size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = m_cells[pos & m_mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			intptr_t diff = intptr_t(seq) - intptr_t(pos);
+			if (diff == 0) {
+				if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.data = item;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = m_enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+	T* try_pop() {
+		size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = m_cells[pos & m_mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+			if (diff == 0) {
+				if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					T* item = cell.data;
+					cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+					return item;
+				}
+			}
+			else if (diff < 0) {
+				return nullptr;
+			}
+			else {
+				pos = m_dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T* data;
+	};
+	Cell* m_cells;
+	size_t m_mask;
+	char m_pad0[detail::CACHE_LINE_SIZE - sizeof(Cell*) - sizeof(size_t)];
+	std::atomic<size_t> m_enqueuePos;
+	char m_pad1[detail::CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> m_dequeuePos;
+	char m_pad2[detail::CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include "design_pattern.h"
+
+namespace detail {
+
+	struct mpsc_node {
+		mpsc_node() : next(nullptr) {}
+		std::atomic<mpsc_node*> next;
+	};
+
+	enum { CACHE_LINE_SIZE = 64 };
+}
+
+//intrusive multi-producer/single-consumer queue (Vyukov).
+//T must derive from detail::mpsc_node, the queue never owns the nodes.
+//push is wait-free, try_pop is lock-free and must only be called by one thread at a time.
+template<typename T>
+class intrusive_mpsc_queue : public noncopyable {
+public:
+	intrusive_mpsc_queue() : m_back(&m_stub), m_front(&m_stub) {}
+	void push(T* node) {
+		push(node, node);
+	}
+	//push a chain first->...->last which is already linked through next.
+	void push(T* first, T* last) {
+		link(first, last);
+	}
+	//nullptr means empty, or a producer is between exchange and link.
+	T* try_pop() {
+		detail::mpsc_node* front = m_front;
+		detail::mpsc_node* next = front->next.load(std::memory_order_acquire);
+		if (front == &m_stub) {
+			if (next == nullptr) {
+				return nullptr;
+			}
+			m_front = next;
+			front = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if (next != nullptr) {
+			m_front = next;
+			return static_cast<T*>(front);
+		}
+		if (front != m_back.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		link(&m_stub, &m_stub);
+		next = front->next.load(std::memory_order_acquire);
+		if (next != nullptr) {
+			m_front = next;
+			return static_cast<T*>(front);
+		}
+		return nullptr;
+	}
+	//only meaningful on the consumer side.
+	bool empty() const {
+		return m_front == &m_stub && m_stub.next.load(std::memory_order_acquire) == nullptr;
+	}
+private:
+	void link(detail::mpsc_node* first, detail::mpsc_node* last) {
+		last->next.store(nullptr, std::memory_order_relaxed);
+		detail::mpsc_node* prev = m_back.exchange(last, std::memory_order_acq_rel);
+		prev->next.store(first, std::memory_order_release);
+	}
+	std::atomic<detail::mpsc_node*> m_back;
+	char m_pad0[detail::CACHE_LINE_SIZE - sizeof(std::atomic<detail::mpsc_node*>)];
+	detail::mpsc_node* m_front;
+	detail::mpsc_node m_stub;
+	char m_pad1[detail::CACHE_LINE_SIZE - sizeof(detail::mpsc_node*) - sizeof(detail::mpsc_node)];
+};
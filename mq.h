@@ -1,11 +1,25 @@
 #pragma once
 #include <deque>
+#include <vector>
+#include <iterator>
 #include <mutex>
 #include "design_pattern.h"
+#include "mpsc_queue.h"
+#include "slab_allocator.h"
 #include <memory>
 #include <string>
 #include <condition_variable>
 #include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+#ifndef ACTOR_INLINE_PAYLOAD_SIZE
+//payloads up to this many bytes that are moved or emplaced into a send live inside the
+//envelope, one allocation per message instead of two. 0 keeps every payload on the heap.
+#define ACTOR_INLINE_PAYLOAD_SIZE 64
+#endif
 
 enum SEND_MESSAGE_RESULT
 {
@@ -14,24 +28,178 @@ enum SEND_MESSAGE_RESULT
 	E_SMR_CLOSED,
 	E_SMR_MEMORY,
 	E_SMR_NOTFOUND,
-	E_SMR_NOTREGISTER
+	E_SMR_NOTREGISTER,
+	//bounded mailbox: the sender waited the whole block timeout.
+	//ask: no reply within the timeout.
+	E_SMR_TIMEOUT,
+	//bounded mailbox only: the message was discarded by E_BP_DROP_NEWEST.
+	E_SMR_DROPPED,
+	//bounded mailbox only: the ring was full and E_BP_REJECT refused the message.
+	E_SMR_REJECTED,
+	//number of results, never returned.
+	E_SMR_RESULTS
+};
+
+//mailbox lane picked per send, a higher lane is always dequeued first.
+enum MESSAGE_PRIORITY
+{
+	E_MP_NORMAL,
+	E_MP_HIGH,
+	//control messages: stats requests, shutdown.
+	E_MP_SYSTEM,
+	E_MP_LEVELS
+};
+
+//outcome of one sendBatch to one target, a batch is accepted or rejected as a whole.
+struct SendBatchResult
+{
+	SendBatchResult() : result(E_SMR_OK), accepted(0), rejected(0) {}
+	SEND_MESSAGE_RESULT result;
+	size_t accepted;
+	size_t rejected;
 };
 
 namespace detail {
+	//picks the envelope constructor that builds the payload in place.
+	struct emplace_tag {};
+
+	//what an envelope holds its payload in, used like the std::unique_ptr it replaced.
+	//the pointer API hands over a heap object, emplaced or moved payloads that are small
+	//enough are built in the storage right here instead, see ACTOR_INLINE_PAYLOAD_SIZE.
+	template<typename T>
+	class payload : public noncopyable {
+		enum {
+			STORE_INLINE = ACTOR_INLINE_PAYLOAD_SIZE > 0 && sizeof(T) <= ACTOR_INLINE_PAYLOAD_SIZE
+				&& std::alignment_of<T>::value <= std::alignment_of<std::max_align_t>::value
+				&& std::is_move_constructible<T>::value
+		};
+		typedef std::integral_constant<bool, STORE_INLINE != 0> store_inline;
+	public:
+		payload() : m_ptr(nullptr) {}
+		explicit payload(T* ptr) : m_ptr(ptr) {}
+		template<typename ...Args>
+		explicit payload(emplace_tag, Args&&... args) : m_ptr(nullptr) {
+			emplace(store_inline(), std::forward<Args>(args)...);
+		}
+		payload(payload&& rhs) : m_ptr(nullptr) {
+			take(rhs, store_inline());
+		}
+		~payload() {
+			reset();
+		}
+		T* get() const {
+			return m_ptr;
+		}
+		T& operator*() const {
+			return *m_ptr;
+		}
+		T* operator->() const {
+			return m_ptr;
+		}
+		explicit operator bool() const {
+			return m_ptr != nullptr;
+		}
+		//true when the payload lives in the envelope.
+		bool inlined() const {
+			return m_ptr != nullptr && static_cast<const void*>(m_ptr) == static_cast<const void*>(&m_storage);
+		}
+		void reset(T* ptr = nullptr) {
+			T* old = m_ptr;
+			bool wasInline = inlined();
+			m_ptr = ptr;
+			if (wasInline) {
+				old->~T();
+			}
+			else {
+				delete old;
+			}
+		}
+		//always a heap object, an inline payload is moved out into one.
+		T* release() {
+			return release(store_inline());
+		}
+	private:
+		template<typename ...Args>
+		void emplace(std::true_type, Args&&... args) {
+			m_ptr = new (&m_storage) T(std::forward<Args>(args)...);
+		}
+		template<typename ...Args>
+		void emplace(std::false_type, Args&&... args) {
+			m_ptr = new T(std::forward<Args>(args)...);
+		}
+		void take(payload& rhs, std::true_type) {
+			if (rhs.inlined()) {
+				m_ptr = new (&m_storage) T(std::move(*rhs.m_ptr));
+				rhs.reset();
+				return;
+			}
+			take(rhs, std::false_type());
+		}
+		void take(payload& rhs, std::false_type) {
+			m_ptr = rhs.m_ptr;
+			rhs.m_ptr = nullptr;
+		}
+		T* release(std::true_type) {
+			if (inlined()) {
+				T* ptr = new T(std::move(*m_ptr));
+				reset();
+				return ptr;
+			}
+			return release(std::false_type());
+		}
+		T* release(std::false_type) {
+			T* ptr = m_ptr;
+			m_ptr = nullptr;
+			return ptr;
+		}
+		T* m_ptr;
+		typename std::aligned_storage<STORE_INLINE ? sizeof(T) : 1, STORE_INLINE ? std::alignment_of<T>::value : 1>::type m_storage;
+	};
 
 	template<typename ActorIdType = std::string, typename MessageIdType = std::string, typename MessageType = std::string>
-	class Message : public noncopyable {
+	class Message : public noncopyable, public mpsc_node {
 	public:
 		typedef ActorIdType actorIdType;
-		Message() : msg(nullptr) {}
-		Message(const ActorIdType& src_, const MessageIdType& id_, MessageType* msg_)
-			: src(src_), id(id_), msg(msg_)
+		Message() : msg(nullptr), priority(E_MP_NORMAL), replyToken(0), enqueuedAt(0), traceId(0) {}
+		Message(const ActorIdType& src_, const MessageIdType& id_, MessageType* msg_, MESSAGE_PRIORITY priority_ = E_MP_NORMAL, uint64_t replyToken_ = 0)
+			: src(src_), id(id_), msg(msg_), priority(priority_), replyToken(replyToken_), enqueuedAt(0), traceId(0)
+		{}
+		//the payload constructed from args, inside the envelope if it fits.
+		template<typename ...Args>
+		Message(emplace_tag tag, const ActorIdType& src_, const MessageIdType& id_, MESSAGE_PRIORITY priority_, Args&&... args)
+			: src(src_), id(id_), msg(tag, std::forward<Args>(args)...), priority(priority_), replyToken(0), enqueuedAt(0), traceId(0)
 		{}
-		Message(Message<ActorIdType, MessageIdType>&& rhs) 
-		: src(rhs.src), id(rhs.id), msg(rhs.msg) {}
+		Message(Message&& rhs)
+		: src(rhs.src), id(rhs.id), msg(std::move(rhs.msg)), priority(rhs.priority), replyToken(rhs.replyToken), enqueuedAt(rhs.enqueuedAt), traceId(rhs.traceId) {}
+#ifndef ACTOR_NO_MESSAGE_POOL
+		//envelopes come from a per-thread slab, define ACTOR_NO_MESSAGE_POOL to use the heap.
+		static void* operator new(size_t size) {
+			if (size != sizeof(Message)) {
+				return ::operator new(size);
+			}
+			return slab_allocator<sizeof(Message)>::allocate();
+		}
+		static void operator delete(void* p, size_t size) {
+			if (size != sizeof(Message)) {
+				::operator delete(p);
+				return;
+			}
+			slab_allocator<sizeof(Message)>::deallocate(p);
+		}
+		static slab_stats allocatorStats() {
+			return slab_allocator<sizeof(Message)>::stats();
+		}
+#endif
 		ActorIdType src;
 		MessageIdType id;
-		std::unique_ptr<MessageType> msg;
+		payload<MessageType> msg;
+		MESSAGE_PRIORITY priority;
+		//set by ActorManager::ask, where reply() delivers to. 0 for plain sends.
+		uint64_t replyToken;
+		//ActorMetrics::now() when it was handed to the mailbox.
+		uint64_t enqueuedAt;
+		//see message_tracer.
+		uint64_t traceId;
 	};
 }
 
@@ -39,16 +207,31 @@ template<typename MessageType = std::unique_ptr<detail::Message<>>>
 class message_queue : public noncopyable {
 public:
 	message_queue(size_t overhead) : m_closed(false), m_overhead(overhead)
-	{}
+	{
+		for (unsigned int i = 0; i < E_MP_LEVELS; i++) {
+			m_lanes[i] = 0;
+		}
+	}
 	~message_queue() {
 	}
-	SEND_MESSAGE_RESULT push(MessageType&& msg) {
+	//a message on lane n goes behind everything on lanes >= n and ahead of the rest.
+	SEND_MESSAGE_RESULT push(MessageType&& msg, unsigned int lane = 0) {
 		if (m_closed) {
 			return E_SMR_CLOSED;
 		}
 		std::lock_guard<std::mutex> lck(m_mutex);
 		try {
-			m_msgs.push_back(std::move(msg));
+			if (lane == 0) {
+				m_msgs.push_back(std::move(msg));
+			}
+			else {
+				size_t pos = 0;
+				for (unsigned int i = lane; i < E_MP_LEVELS; i++) {
+					pos += m_lanes[i];
+				}
+				m_msgs.insert(m_msgs.begin() + pos, std::move(msg));
+				m_lanes[lane]++;
+			}
 		}
 		catch (...) {
 			return E_SMR_MEMORY;
@@ -60,6 +243,26 @@ public:
 		}
 		return E_SMR_OK;
 	}
+	//one lock and one notify for the whole batch, msgs is left empty on success.
+	SEND_MESSAGE_RESULT push(std::vector<MessageType>& msgs) {
+		if (m_closed) {
+			return E_SMR_CLOSED;
+		}
+		std::lock_guard<std::mutex> lck(m_mutex);
+		try {
+			m_msgs.insert(m_msgs.end(), std::make_move_iterator(msgs.begin()), std::make_move_iterator(msgs.end()));
+		}
+		catch (...) {
+			return E_SMR_MEMORY;
+		}
+		msgs.clear();
+		m_cv.notify_one();
+		if (m_overhead > 0 && m_msgs.size() > m_overhead)
+		{
+			return E_SMR_OVERHEAD;
+		}
+		return E_SMR_OK;
+	}
 	bool pop(MessageType& msg) {
 		std::unique_lock<std::mutex> lck(m_mutex);
 		while (m_msgs.empty() && !m_closed) {
@@ -70,6 +273,7 @@ public:
 		}
 		msg = std::move(m_msgs.front());
 		m_msgs.pop_front();
+		popped(1);
 		return true;
 	}
 	bool try_pop(MessageType& msg) {
@@ -79,8 +283,21 @@ public:
 		}
 		msg = std::move(m_msgs.front());
 		m_msgs.pop_front();
+		popped(1);
 		return true;
 	}
+	//move up to max pending messages to msgs under one lock, block while empty.
+	bool pop(std::vector<MessageType>& msgs, size_t max) {
+		std::unique_lock<std::mutex> lck(m_mutex);
+		while (m_msgs.empty() && !m_closed) {
+			m_cv.wait(lck);
+		}
+		return take(msgs, max) != 0;
+	}
+	size_t try_pop(std::vector<MessageType>& msgs, size_t max) {
+		std::unique_lock<std::mutex> lck(m_mutex);
+		return take(msgs, max);
+	}
 	bool overhead() {
 		return m_overhead > 0 ? size() > m_overhead : false;
 	}
@@ -98,10 +315,27 @@ public:
 		m_cv.notify_all();
 	}
 private:
+	size_t take(std::vector<MessageType>& msgs, size_t max) {
+		size_t n = m_msgs.size() < max ? m_msgs.size() : max;
+		msgs.insert(msgs.end(), std::make_move_iterator(m_msgs.begin()), std::make_move_iterator(m_msgs.begin() + n));
+		m_msgs.erase(m_msgs.begin(), m_msgs.begin() + n);
+		popped(n);
+		return n;
+	}
+	//the front of m_msgs holds the priority lanes, highest first.
+	void popped(size_t n) {
+		for (unsigned int i = E_MP_LEVELS - 1; i > 0 && n > 0; i--) {
+			size_t k = m_lanes[i] < n ? m_lanes[i] : n;
+			m_lanes[i] -= k;
+			n -= k;
+		}
+	}
 	std::atomic<bool> m_closed;
 	std::mutex m_mutex;
 	std::condition_variable m_cv;
 	std::deque<MessageType> m_msgs;
 	size_t m_overhead;
+	//messages queued per priority lane, m_lanes[0] is unused.
+	size_t m_lanes[E_MP_LEVELS];
 };
 
@@ -0,0 +1,109 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include "design_pattern.h"
+#include "mpsc_queue.h"
+
+//epoch based read-copy-update.
+//readers only write their own per-thread slot, a writer unpublishes an object,
+//calls synchronize() to wait for the readers that may still see it, then frees it.
+class rcu_domain : public noncopyable {
+public:
+	static rcu_domain& global() {
+		static rcu_domain domain;
+		return domain;
+	}
+	~rcu_domain() {
+		Record* rec = m_records.load();
+		while (rec) {
+			Record* next = rec->next;
+			delete rec;
+			rec = next;
+		}
+	}
+	void read_lock() {
+		Record* rec = local();
+		if (rec->nesting++ == 0) {
+			rec->epoch.store(m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+	}
+	void read_unlock() {
+		Record* rec = local();
+		if (--rec->nesting == 0) {
+			rec->epoch.store(0, std::memory_order_release);
+		}
+	}
+	//wait until every read section entered before the call has left.
+	//must not be called inside a read section.
+	void synchronize() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		uint64_t target = m_epoch.fetch_add(1) + 1;
+		for (Record* rec = m_records.load(std::memory_order_acquire); rec; rec = rec->next) {
+			for (;;) {
+				uint64_t e = rec->epoch.load(std::memory_order_acquire);
+				if (e == 0 || e >= target) {
+					break;
+				}
+				std::this_thread::yield();
+			}
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+private:
+	rcu_domain() : m_epoch(1), m_records(nullptr) {}
+	struct Record {
+		Record() : epoch(0), inUse(true), nesting(0), next(nullptr) {}
+		std::atomic<uint64_t> epoch;
+		std::atomic<bool> inUse;
+		unsigned nesting;
+		Record* next;
+		char pad[detail::CACHE_LINE_SIZE];
+	};
+	//the slot goes back to the free list when the thread exits.
+	struct ThreadRecord {
+		ThreadRecord() : rec(nullptr) {}
+		~ThreadRecord() {
+			if (rec) {
+				rec->epoch.store(0, std::memory_order_release);
+				rec->inUse.store(false, std::memory_order_release);
+			}
+		}
+		Record* rec;
+	};
+	Record* local() {
+		static thread_local ThreadRecord tls;
+		if (!tls.rec) {
+			tls.rec = acquire();
+		}
+		return tls.rec;
+	}
+	Record* acquire() {
+		for (Record* rec = m_records.load(std::memory_order_acquire); rec; rec = rec->next) {
+			bool expected = false;
+			if (!rec->inUse.load(std::memory_order_relaxed) && rec->inUse.compare_exchange_strong(expected, true)) {
+				return rec;
+			}
+		}
+		Record* rec = new Record;
+		Record* head = m_records.load(std::memory_order_relaxed);
+		do {
+			rec->next = head;
+		} while (!m_records.compare_exchange_weak(head, rec, std::memory_order_release, std::memory_order_relaxed));
+		return rec;
+	}
+	std::atomic<uint64_t> m_epoch;
+	char m_pad[detail::CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+	std::atomic<Record*> m_records;
+};
+
+class rcu_read_guard : public noncopyable {
+public:
+	rcu_read_guard() {
+		rcu_domain::global().read_lock();
+	}
+	~rcu_read_guard() {
+		rcu_domain::global().read_unlock();
+	}
+};
@@ -0,0 +1,332 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <cstdint>
+#include "design_pattern.h"
+#include "rcu.h"
+
+//concurrent hash map for read-mostly lookups.
+//readers never lock and never write shared memory: they walk immutable bucket chains
+//under an rcu_read_guard. Writers serialize per shard, publish with release stores,
+//and wait for a grace period before freeing what they unlinked.
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class sharded_registry : public noncopyable {
+	struct Node {
+		Node(const Key& key_, const Value& value_, uint64_t hash_) : key(key_), value(value_), hash(hash_), next(nullptr) {}
+		Key key;
+		Value value;
+		uint64_t hash;
+		std::atomic<Node*> next;
+	};
+	struct Table {
+		explicit Table(size_t size) : mask(size - 1), buckets(new std::atomic<Node*>[size]) {
+			for (size_t i = 0; i < size; i++) {
+				buckets[i].store(nullptr, std::memory_order_relaxed);
+			}
+		}
+		~Table() {
+			delete[] buckets;
+		}
+		void destroyNodes() {
+			for (size_t i = 0; i <= mask; i++) {
+				Node* node = buckets[i].load(std::memory_order_relaxed);
+				while (node) {
+					Node* next = node->next.load(std::memory_order_relaxed);
+					delete node;
+					node = next;
+				}
+			}
+		}
+		size_t mask;
+		std::atomic<Node*>* buckets;
+	};
+	struct Shard {
+		Shard() : table(new Table(INITIAL_BUCKETS)), count(0) {}
+		std::mutex mutex;
+		std::atomic<Table*> table;
+		size_t count;
+		char pad[detail::CACHE_LINE_SIZE];
+	};
+public:
+	explicit sharded_registry(size_t shards = 64) {
+		size_t n = 1;
+		while (n < shards) {
+			n <<= 1;
+		}
+		m_shardMask = n - 1;
+		m_shards = new Shard[n];
+	}
+	~sharded_registry() {
+		for (size_t i = 0; i <= m_shardMask; i++) {
+			Table* table = m_shards[i].table.load();
+			table->destroyNodes();
+			delete table;
+		}
+		delete[] m_shards;
+	}
+	//the caller must hold an rcu_read_guard for as long as it uses the result.
+	Value* find(const Key& key) const {
+		uint64_t h = hash(key);
+		Table* table = shard(h).table.load(std::memory_order_acquire);
+		Node* node = table->buckets[bucket(h, table)].load(std::memory_order_acquire);
+		while (node) {
+			if (node->hash == h && node->key == key) {
+				return &node->value;
+			}
+			node = node->next.load(std::memory_order_acquire);
+		}
+		return nullptr;
+	}
+	bool contains(const Key& key) const {
+		rcu_read_guard guard;
+		return find(key) != nullptr;
+	}
+	//fn(key, value) for every entry, concurrent inserts and erases may or may not be seen.
+	//the caller must hold an rcu_read_guard, keep it short: it holds up every grace period.
+	template<typename Fn>
+	void forEach(Fn fn) const {
+		for (size_t i = 0; i <= m_shardMask; i++) {
+			Table* table = m_shards[i].table.load(std::memory_order_acquire);
+			for (size_t b = 0; b <= table->mask; b++) {
+				for (Node* node = table->buckets[b].load(std::memory_order_acquire); node; node = node->next.load(std::memory_order_acquire)) {
+					fn(node->key, node->value);
+				}
+			}
+		}
+	}
+	//false if the key already exists.
+	bool insert(const Key& key, const Value& value) {
+		uint64_t h = hash(key);
+		Shard& s = shard(h);
+		Table* retired = nullptr;
+		{
+			std::lock_guard<std::mutex> lck(s.mutex);
+			Table* table = s.table.load(std::memory_order_relaxed);
+			std::atomic<Node*>& head = table->buckets[bucket(h, table)];
+			for (Node* node = head.load(std::memory_order_relaxed); node; node = node->next.load(std::memory_order_relaxed)) {
+				if (node->hash == h && node->key == key) {
+					return false;
+				}
+			}
+			Node* node = new Node(key, value, h);
+			node->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			head.store(node, std::memory_order_release);
+			if (++s.count > (table->mask + 1) * 2) {
+				retired = table;
+				s.table.store(rehash(table), std::memory_order_release);
+			}
+		}
+		if (retired) {
+			rcu_domain::global().synchronize();
+			retired->destroyNodes();
+			delete retired;
+		}
+		return true;
+	}
+	//the removed value is moved to out once no reader can see it any more.
+	bool erase(const Key& key, Value* out = nullptr) {
+		uint64_t h = hash(key);
+		Shard& s = shard(h);
+		Node* victim = nullptr;
+		{
+			std::lock_guard<std::mutex> lck(s.mutex);
+			Table* table = s.table.load(std::memory_order_relaxed);
+			std::atomic<Node*>* link = &table->buckets[bucket(h, table)];
+			for (Node* node = link->load(std::memory_order_relaxed); node; node = link->load(std::memory_order_relaxed)) {
+				if (node->hash == h && node->key == key) {
+					link->store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+					victim = node;
+					--s.count;
+					break;
+				}
+				link = &node->next;
+			}
+		}
+		if (!victim) {
+			return false;
+		}
+		rcu_domain::global().synchronize();
+		if (out) {
+			*out = std::move(victim->value);
+		}
+		delete victim;
+		return true;
+	}
+	//remove everything, values are handed over after a grace period.
+	std::vector<Value> drain() {
+		std::vector<Table*> retired;
+		for (size_t i = 0; i <= m_shardMask; i++) {
+			Shard& s = m_shards[i];
+			std::lock_guard<std::mutex> lck(s.mutex);
+			retired.push_back(s.table.load(std::memory_order_relaxed));
+			s.table.store(new Table(INITIAL_BUCKETS), std::memory_order_release);
+			s.count = 0;
+		}
+		rcu_domain::global().synchronize();
+		std::vector<Value> values;
+		for (auto it = retired.begin(); it != retired.end(); ++it) {
+			Table* table = *it;
+			for (size_t i = 0; i <= table->mask; i++) {
+				for (Node* node = table->buckets[i].load(std::memory_order_relaxed); node; node = node->next.load(std::memory_order_relaxed)) {
+					values.push_back(std::move(node->value));
+				}
+			}
+			table->destroyNodes();
+			delete table;
+		}
+		return values;
+	}
+private:
+	enum { INITIAL_BUCKETS = 16 };
+	static uint64_t hash(const Key& key) {
+		//murmur3 finalizer, std::hash of integers is the identity.
+		uint64_t h = static_cast<uint64_t>(Hash()(key));
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+	Shard& shard(uint64_t h) const {
+		return m_shards[h & m_shardMask];
+	}
+	size_t bucket(uint64_t h, const Table* table) const {
+		return static_cast<size_t>(h >> 20) & table->mask;
+	}
+	//readers may be walking the old table, so the new one gets its own nodes.
+	Table* rehash(Table* table) const {
+		Table* bigger = new Table((table->mask + 1) * 4);
+		for (size_t i = 0; i <= table->mask; i++) {
+			for (Node* node = table->buckets[i].load(std::memory_order_relaxed); node; node = node->next.load(std::memory_order_relaxed)) {
+				std::atomic<Node*>& head = bigger->buckets[bucket(node->hash, bigger)];
+				Node* copy = new Node(node->key, node->value, node->hash);
+				copy->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+				head.store(copy, std::memory_order_relaxed);
+			}
+		}
+		return bigger;
+	}
+	Shard* m_shards;
+	size_t m_shardMask;
+};
+
+namespace detail {
+	//whether std::hash<T> can hash a T, it cannot for most user defined types.
+	template<typename T>
+	class is_hashable {
+		template<typename U>
+		static auto test(int) -> decltype(std::hash<U>()(std::declval<const U&>()), std::true_type());
+		template<typename>
+		static std::false_type test(...);
+	public:
+		static const bool value = decltype(test<T>(0))::value;
+	};
+
+	template<typename T>
+	class is_less_comparable {
+		template<typename U>
+		static auto test(int) -> decltype(bool(std::declval<const U&>() < std::declval<const U&>()), std::true_type());
+		template<typename>
+		static std::false_type test(...);
+	public:
+		static const bool value = decltype(test<T>(0))::value;
+	};
+}
+
+//the same interface over one std::map behind an RCU pointer, for keys without std::hash.
+//reads cost what they cost in sharded_registry, every insert and erase copies the map
+//and waits for a grace period, which suits the few writes of an actor registry. Values
+//are copied along, change them only through what they point to.
+template<typename Key, typename Value>
+class ordered_registry : public noncopyable {
+	static_assert(detail::is_less_comparable<Key>::value, "ordered_registry needs Key < Key, give the key std::hash and operator== or operator<");
+	typedef std::map<Key, Value> Map;
+public:
+	ordered_registry() : m_map(new Map()) {}
+	~ordered_registry() {
+		delete m_map.load();
+	}
+	//the caller must hold an rcu_read_guard for as long as it uses the result.
+	Value* find(const Key& key) const {
+		Map* map = m_map.load(std::memory_order_acquire);
+		auto it = map->find(key);
+		return it != map->end() ? &it->second : nullptr;
+	}
+	bool contains(const Key& key) const {
+		rcu_read_guard guard;
+		return find(key) != nullptr;
+	}
+	//the caller must hold an rcu_read_guard.
+	template<typename Fn>
+	void forEach(Fn fn) const {
+		Map* map = m_map.load(std::memory_order_acquire);
+		for (auto it = map->begin(); it != map->end(); ++it) {
+			fn(it->first, it->second);
+		}
+	}
+	//false if the key already exists.
+	bool insert(const Key& key, const Value& value) {
+		Map* retired = nullptr;
+		{
+			std::lock_guard<std::mutex> lck(m_mutex);
+			Map* map = m_map.load(std::memory_order_relaxed);
+			if (map->find(key) != map->end()) {
+				return false;
+			}
+			std::unique_ptr<Map> next(new Map(*map));
+			next->insert(std::make_pair(key, value));
+			m_map.store(next.release(), std::memory_order_release);
+			retired = map;
+		}
+		rcu_domain::global().synchronize();
+		delete retired;
+		return true;
+	}
+	//the removed value is moved to out once no reader can see it any more.
+	bool erase(const Key& key, Value* out = nullptr) {
+		Map* retired = nullptr;
+		{
+			std::lock_guard<std::mutex> lck(m_mutex);
+			Map* map = m_map.load(std::memory_order_relaxed);
+			if (map->find(key) == map->end()) {
+				return false;
+			}
+			std::unique_ptr<Map> next(new Map(*map));
+			next->erase(key);
+			m_map.store(next.release(), std::memory_order_release);
+			retired = map;
+		}
+		rcu_domain::global().synchronize();
+		if (out) {
+			*out = std::move(retired->find(key)->second);
+		}
+		delete retired;
+		return true;
+	}
+	//remove everything, values are handed over after a grace period.
+	std::vector<Value> drain() {
+		Map* retired = nullptr;
+		{
+			std::lock_guard<std::mutex> lck(m_mutex);
+			retired = m_map.load(std::memory_order_relaxed);
+			m_map.store(new Map(), std::memory_order_release);
+		}
+		rcu_domain::global().synchronize();
+		std::vector<Value> values;
+		for (auto it = retired->begin(); it != retired->end(); ++it) {
+			values.push_back(std::move(it->second));
+		}
+		delete retired;
+		return values;
+	}
+private:
+	std::atomic<Map*> m_map;
+	std::mutex m_mutex;
+};
@@ -0,0 +1,200 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include "design_pattern.h"
+#include "work_stealing_deque.h"
+#include "wait_strategy.h"
+
+namespace detail {
+	struct scheduler_worker_tls {
+		const void* owner;
+		unsigned index;
+	};
+	inline scheduler_worker_tls& current_scheduler_worker() {
+		static thread_local scheduler_worker_tls tls = { nullptr, 0 };
+		return tls;
+	}
+}
+
+//one work stealing deque per worker: a worker pushes and pops its own deque LIFO,
+//idle workers steal FIFO from the others. Tasks scheduled from outside the pool
+//(or yielded) go through a shared injection queue. Idle workers spin for a while
+//as the WaitStrategy says, then park.
+template<typename T>
+class work_stealing_scheduler : public noncopyable {
+public:
+	explicit work_stealing_scheduler(unsigned workers, const WaitStrategy& wait = WaitStrategy())
+		: m_closed(false), m_injectSize(0), m_wait(wait) {
+		for (unsigned i = 0; i < workers; i++) {
+			m_workers.emplace_back(new Worker(i));
+		}
+	}
+	size_t workers() const {
+		return m_workers.size();
+	}
+	//must be called by the i-th worker thread before pop.
+	void attach(unsigned index) {
+		auto& tls = detail::current_scheduler_worker();
+		tls.owner = this;
+		tls.index = index;
+	}
+	bool push(T* task) {
+		if (m_closed.load(std::memory_order_acquire)) {
+			return false;
+		}
+		auto& tls = detail::current_scheduler_worker();
+		if (tls.owner == this) {
+			m_workers[tls.index]->tasks.push(task);
+		} else {
+			inject(task);
+		}
+		notify();
+		return true;
+	}
+	//FIFO, behind everything already queued, used when a task gave up its time slice.
+	bool yield(T* task) {
+		if (m_closed.load(std::memory_order_acquire)) {
+			return false;
+		}
+		inject(task);
+		notify();
+		return true;
+	}
+	//block until a task is available, nullptr after close.
+	T* pop(unsigned index) {
+		Worker& self = *m_workers[index];
+		T* task = nullptr;
+		if (m_wait.spinUntil([&]() { return (task = find(self)) != nullptr || m_closed.load(std::memory_order_relaxed); }) && task) {
+			return task;
+		}
+		for (;;) {
+			task = find(self);
+			if (task) {
+				return task;
+			}
+			uint32_t key = m_idle.prepareWait();
+			if (m_closed.load() || hasWork()) {
+				m_idle.cancelWait();
+				if (m_closed.load()) {
+					return nullptr;
+				}
+				continue;
+			}
+			m_idle.wait(key);
+		}
+	}
+	//used after the workers stopped, to drain what is left.
+	T* try_pop() {
+		T* task = takeInjected();
+		if (task) {
+			return task;
+		}
+		for (auto it = m_workers.begin(); it != m_workers.end(); ++it) {
+			while (!(*it)->tasks.empty()) {
+				task = (*it)->tasks.steal();
+				if (task) {
+					return task;
+				}
+			}
+		}
+		return nullptr;
+	}
+	void close() {
+		m_closed.store(true);
+		m_idle.notifyAll();
+	}
+private:
+	enum { INJECT_CHECK_INTERVAL = 61 };
+	struct Worker {
+		explicit Worker(unsigned index) : tick(0), seed(index * 2654435761u + 1) {}
+		work_stealing_deque<T*> tasks;
+		unsigned tick;
+		unsigned seed;
+	};
+	T* find(Worker& self) {
+		T* task = nullptr;
+		//look at the shared queue now and then, so yielded tasks are not starved by local work.
+		if (++self.tick % INJECT_CHECK_INTERVAL == 0) {
+			task = takeInjected();
+			if (task) {
+				return task;
+			}
+		}
+		task = self.tasks.pop();
+		if (task) {
+			return task;
+		}
+		task = takeInjected();
+		if (task) {
+			return task;
+		}
+		return steal(self);
+	}
+	T* steal(Worker& self) {
+		size_t n = m_workers.size();
+		if (n < 2) {
+			return nullptr;
+		}
+		self.seed ^= self.seed << 13;
+		self.seed ^= self.seed >> 17;
+		self.seed ^= self.seed << 5;
+		size_t start = self.seed % n;
+		for (size_t i = 0; i < n; i++) {
+			Worker& victim = *m_workers[(start + i) % n];
+			if (&victim == &self) {
+				continue;
+			}
+			while (!victim.tasks.empty()) {
+				T* task = victim.tasks.steal();
+				if (task) {
+					return task;
+				}
+			}
+		}
+		return nullptr;
+	}
+	void inject(T* task) {
+		std::lock_guard<std::mutex> lck(m_injectMutex);
+		m_inject.push_back(task);
+		m_injectSize.fetch_add(1, std::memory_order_release);
+	}
+	T* takeInjected() {
+		if (m_injectSize.load(std::memory_order_acquire) == 0) {
+			return nullptr;
+		}
+		std::lock_guard<std::mutex> lck(m_injectMutex);
+		if (m_inject.empty()) {
+			return nullptr;
+		}
+		T* task = m_inject.front();
+		m_inject.pop_front();
+		m_injectSize.fetch_sub(1, std::memory_order_relaxed);
+		return task;
+	}
+	bool hasWork() const {
+		if (m_injectSize.load() != 0) {
+			return true;
+		}
+		for (auto it = m_workers.begin(); it != m_workers.end(); ++it) {
+			if (!(*it)->tasks.empty()) {
+				return true;
+			}
+		}
+		return false;
+	}
+	void notify() {
+		//the deque push is not seq_cst, pairs with prepareWait in pop.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		m_idle.notifyOne();
+	}
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::atomic<bool> m_closed;
+	std::mutex m_injectMutex;
+	std::deque<T*> m_inject;
+	std::atomic<size_t> m_injectSize;
+	WaitStrategy m_wait;
+	event_count m_idle;
+};
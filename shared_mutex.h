@@ -124,7 +124,7 @@ inline void shared_mutex::lock_shared()
 
 inline bool shared_mutex::try_lock_shared()
 {
-	return pthread_rwlock_tryrdlock(&m_lock);
+	return pthread_rwlock_tryrdlock(&m_lock) == 0;
 }
 
 inline void shared_mutex::unlock_shared()
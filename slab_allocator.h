@@ -0,0 +1,170 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "design_pattern.h"
+#include "spin_lock.h"
+
+struct slab_stats
+{
+	//calls into the system allocator, each one is a chunk of objects.
+	uint64_t chunks;
+	uint64_t bytes;
+	//batches a thread handed back to / took from the shared depot.
+	uint64_t batchesReturned;
+	uint64_t batchesTaken;
+};
+
+//fixed size allocator with a free list per thread.
+//objects freed on another thread land in that thread's cache, which hands them back
+//to the shared depot BATCH at a time. The depot is a lock-free stack of batches, only
+//growing it takes a lock.
+template<size_t Size>
+class slab_allocator : public noncopyable {
+	struct FreeNode {
+		FreeNode* next;
+		//the next batch in the depot and the size of this one, first node of a batch only.
+		std::atomic<FreeNode*> link;
+		size_t count;
+	};
+	static const size_t ALIGN = 16;
+	static const size_t SLOT_SIZE = ((Size < sizeof(FreeNode) ? sizeof(FreeNode) : Size) + ALIGN - 1) & ~(ALIGN - 1);
+	static const size_t BATCH = 64;
+	static const size_t CHUNK_OBJECTS = BATCH * 4;
+	struct Batch {
+		FreeNode* head;
+		size_t count;
+	};
+	class Depot : public noncopyable {
+	public:
+		Depot() : m_chunks(0), m_bytes(0), m_batchesReturned(0), m_batchesTaken(0) {}
+		~Depot() {
+			for (auto it = m_memory.begin(); it != m_memory.end(); ++it) {
+				::operator delete(*it);
+			}
+		}
+		void put(const Batch& batch) {
+			m_batchesReturned.fetch_add(1, std::memory_order_relaxed);
+			batch.head->count = batch.count;
+			m_batches.push(batch.head);
+		}
+		Batch take() {
+			if (FreeNode* head = m_batches.pop()) {
+				m_batchesTaken.fetch_add(1, std::memory_order_relaxed);
+				Batch batch = { head, head->count };
+				return batch;
+			}
+			return grow();
+		}
+		slab_stats stats() const {
+			slab_stats s;
+			s.chunks = m_chunks.load(std::memory_order_relaxed);
+			s.bytes = m_bytes.load(std::memory_order_relaxed);
+			s.batchesReturned = m_batchesReturned.load(std::memory_order_relaxed);
+			s.batchesTaken = m_batchesTaken.load(std::memory_order_relaxed);
+			return s;
+		}
+	private:
+		Batch grow() {
+			char* chunk = static_cast<char*>(::operator new(SLOT_SIZE * CHUNK_OBJECTS));
+			m_chunks.fetch_add(1, std::memory_order_relaxed);
+			m_bytes.fetch_add(SLOT_SIZE * CHUNK_OBJECTS, std::memory_order_relaxed);
+			Batch batch = { nullptr, CHUNK_OBJECTS };
+			for (size_t i = CHUNK_OBJECTS; i > 0; --i) {
+				FreeNode* node = reinterpret_cast<FreeNode*>(chunk + (i - 1) * SLOT_SIZE);
+				node->next = batch.head;
+				batch.head = node;
+			}
+			std::lock_guard<spin_lock> lck(m_lock);
+			m_memory.push_back(chunk);
+			return batch;
+		}
+		detail::tagged_stack<FreeNode> m_batches;
+		//guards m_memory.
+		spin_lock m_lock;
+		std::vector<void*> m_memory;
+		std::atomic<uint64_t> m_chunks;
+		std::atomic<uint64_t> m_bytes;
+		std::atomic<uint64_t> m_batchesReturned;
+		std::atomic<uint64_t> m_batchesTaken;
+	};
+	struct Cache {
+		Cache() : head(nullptr), count(0) {}
+		~Cache() {
+			if (head) {
+				Batch batch = { head, count };
+				depot().put(batch);
+			}
+		}
+		FreeNode* head;
+		size_t count;
+	};
+public:
+	static void* allocate() {
+		Cache& cache = local();
+		if (!cache.head) {
+			Batch batch = depot().take();
+			cache.head = batch.head;
+			cache.count = batch.count;
+		}
+		FreeNode* node = cache.head;
+		cache.head = node->next;
+		--cache.count;
+		return node;
+	}
+	static void deallocate(void* p) {
+		Cache& cache = local();
+		FreeNode* node = static_cast<FreeNode*>(p);
+		node->next = cache.head;
+		cache.head = node;
+		if (++cache.count >= BATCH * 2) {
+			//keep BATCH for ourselves, give the rest back.
+			Batch batch = { cache.head, BATCH };
+			FreeNode* last = cache.head;
+			for (size_t i = 1; i < BATCH; i++) {
+				last = last->next;
+			}
+			cache.head = last->next;
+			cache.count -= BATCH;
+			last->next = nullptr;
+			depot().put(batch);
+		}
+	}
+	static slab_stats stats() {
+		return depot().stats();
+	}
+private:
+	static Depot& depot() {
+		static Depot d;
+		return d;
+	}
+	static Cache& local() {
+		static thread_local Cache cache;
+		return cache;
+	}
+};
+
+//base for message payloads that should come from the slab like envelopes do, new and
+//delete stay as they are: struct Position : slab_allocated<Position> { ... };
+//define ACTOR_NO_MESSAGE_POOL to use the heap.
+template<typename T>
+struct slab_allocated {
+#ifndef ACTOR_NO_MESSAGE_POOL
+	static void* operator new(size_t size) {
+		if (size != sizeof(T)) {
+			return ::operator new(size);
+		}
+		return slab_allocator<sizeof(T)>::allocate();
+	}
+	static void operator delete(void* p, size_t size) {
+		if (size != sizeof(T)) {
+			::operator delete(p);
+			return;
+		}
+		slab_allocator<sizeof(T)>::deallocate(p);
+	}
+#endif
+};
@@ -0,0 +1,261 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+#include <cstdint>
+#include "design_pattern.h"
+#include "rcu.h"
+#include "registry.h"
+
+//registry for integer keys, laid out as a slot array indexed by the low bits of the key.
+//the remaining high bits are the slot's generation: allocate() hands out keys whose
+//generation is bumped every time the slot is freed, so a stale key finds a node with a
+//different key and misses without any hashing. Keys that were not allocated still work,
+//one that lands on a taken slot goes to an overflow hash map instead.
+//reads follow the same rules as sharded_registry: hold an rcu_read_guard around find().
+template<typename Key, typename Value>
+class slot_registry : public noncopyable {
+	typedef typename std::make_unsigned<Key>::type Bits;
+	static const unsigned INDEX_BITS = sizeof(Key) >= 8 ? 24 : 20;
+	static const unsigned CHUNK_BITS = 12;
+	static const size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+	static const size_t CHUNK_COUNT = (size_t(1) << INDEX_BITS) / CHUNK_SIZE;
+	static const Bits INDEX_MASK = (Bits(1) << INDEX_BITS) - 1;
+	struct Node {
+		Node(const Key& key_, const Value& value_) : key(key_), value(value_) {}
+		Key key;
+		Value value;
+	};
+	struct Slot {
+		Slot() : node(nullptr), generation(0), reserved(false) {}
+		std::atomic<Node*> node;
+		//writer side only, under m_mutex.
+		Bits generation;
+		bool reserved;
+	};
+public:
+	slot_registry() : m_next(0), m_overflowCount(0) {
+		for (size_t i = 0; i < CHUNK_COUNT; i++) {
+			m_chunks[i].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+	~slot_registry() {
+		for (size_t i = 0; i < CHUNK_COUNT; i++) {
+			Slot* chunk = m_chunks[i].load(std::memory_order_relaxed);
+			if (!chunk) {
+				continue;
+			}
+			for (size_t j = 0; j < CHUNK_SIZE; j++) {
+				delete chunk[j].node.load(std::memory_order_relaxed);
+			}
+			delete[] chunk;
+		}
+	}
+	//a fresh key whose slot is kept free until it is inserted or erased.
+	//throw std::length_error when every slot is in use.
+	Key allocate() {
+		std::lock_guard<std::mutex> lck(m_mutex);
+		while (!m_free.empty()) {
+			size_t index = m_free.back();
+			m_free.pop_back();
+			Slot& s = slot(index);
+			if (!s.reserved && !s.node.load(std::memory_order_relaxed)) {
+				return reserve(s, index);
+			}
+		}
+		while (m_next <= INDEX_MASK) {
+			size_t index = m_next++;
+			Slot& s = slot(index);
+			if (!s.reserved && !s.node.load(std::memory_order_relaxed)) {
+				return reserve(s, index);
+			}
+		}
+		throw std::length_error("slot_registry is full");
+	}
+	//the caller must hold an rcu_read_guard for as long as it uses the result.
+	Value* find(const Key& key) const {
+		Bits bits = static_cast<Bits>(key);
+		Slot* chunk = m_chunks[(bits & INDEX_MASK) >> CHUNK_BITS].load(std::memory_order_acquire);
+		if (chunk) {
+			Node* node = chunk[bits & (CHUNK_SIZE - 1)].node.load(std::memory_order_acquire);
+			if (node && node->key == key) {
+				return &node->value;
+			}
+		}
+		if (m_overflowCount.load(std::memory_order_acquire) != 0) {
+			return m_overflow.find(key);
+		}
+		return nullptr;
+	}
+	bool contains(const Key& key) const {
+		rcu_read_guard guard;
+		return find(key) != nullptr;
+	}
+	//same rules as sharded_registry::forEach.
+	template<typename Fn>
+	void forEach(Fn fn) const {
+		for (size_t i = 0; i < CHUNK_COUNT; i++) {
+			Slot* chunk = m_chunks[i].load(std::memory_order_acquire);
+			if (!chunk) {
+				continue;
+			}
+			for (size_t j = 0; j < CHUNK_SIZE; j++) {
+				Node* node = chunk[j].node.load(std::memory_order_acquire);
+				if (node) {
+					fn(node->key, node->value);
+				}
+			}
+		}
+		if (m_overflowCount.load(std::memory_order_acquire) != 0) {
+			m_overflow.forEach(fn);
+		}
+	}
+	//false if the key already exists.
+	bool insert(const Key& key, const Value& value) {
+		Bits bits = static_cast<Bits>(key);
+		Bits generation = bits >> INDEX_BITS;
+		std::lock_guard<std::mutex> lck(m_mutex);
+		Slot& s = slot(static_cast<size_t>(bits & INDEX_MASK));
+		Node* node = s.node.load(std::memory_order_relaxed);
+		if (node && node->key == key) {
+			return false;
+		}
+		if (!node && (!s.reserved || s.generation == generation) && !m_overflow.contains(key)) {
+			s.generation = generation;
+			s.reserved = false;
+			s.node.store(new Node(key, value), std::memory_order_release);
+			return true;
+		}
+		m_overflowCount.fetch_add(1);
+		if (!m_overflow.insert(key, value)) {
+			m_overflowCount.fetch_sub(1);
+			return false;
+		}
+		return true;
+	}
+	//the removed value is moved to out once no reader can see it any more.
+	//erasing an allocated key that was never inserted gives its slot back.
+	bool erase(const Key& key, Value* out = nullptr) {
+		Bits bits = static_cast<Bits>(key);
+		size_t index = static_cast<size_t>(bits & INDEX_MASK);
+		Node* victim = nullptr;
+		{
+			std::lock_guard<std::mutex> lck(m_mutex);
+			Slot& s = slot(index);
+			Node* node = s.node.load(std::memory_order_relaxed);
+			if (node && node->key == key) {
+				s.node.store(nullptr, std::memory_order_release);
+				victim = node;
+			}
+			else if (!node && s.reserved && s.generation == (bits >> INDEX_BITS)) {
+				s.reserved = false;
+				release(s, index);
+				return false;
+			}
+		}
+		if (!victim) {
+			if (m_overflow.erase(key, out)) {
+				m_overflowCount.fetch_sub(1);
+				return true;
+			}
+			return false;
+		}
+		rcu_domain::global().synchronize();
+		if (out) {
+			*out = std::move(victim->value);
+		}
+		delete victim;
+		{
+			//only now may allocate() hand out the slot again, unless an insert() of a
+			//key for this slot took it meanwhile, then its own erase gives it back.
+			std::lock_guard<std::mutex> lck(m_mutex);
+			Slot& s = slot(index);
+			if (!s.node.load(std::memory_order_relaxed) && !s.reserved) {
+				release(s, index);
+			}
+		}
+		return true;
+	}
+	//remove everything, values are handed over after a grace period.
+	std::vector<Value> drain() {
+		std::vector<Node*> retired;
+		{
+			std::lock_guard<std::mutex> lck(m_mutex);
+			for (size_t i = 0; i < CHUNK_COUNT; i++) {
+				Slot* chunk = m_chunks[i].load(std::memory_order_relaxed);
+				if (!chunk) {
+					continue;
+				}
+				for (size_t j = 0; j < CHUNK_SIZE; j++) {
+					Node* node = chunk[j].node.exchange(nullptr, std::memory_order_acq_rel);
+					if (node) {
+						retired.push_back(node);
+						release(chunk[j], i * CHUNK_SIZE + j);
+					}
+				}
+			}
+		}
+		std::vector<Value> values = m_overflow.drain();
+		m_overflowCount.store(0);
+		rcu_domain::global().synchronize();
+		for (auto it = retired.begin(); it != retired.end(); ++it) {
+			values.push_back(std::move((*it)->value));
+			delete *it;
+		}
+		return values;
+	}
+private:
+	Slot& slot(size_t index) {
+		std::atomic<Slot*>& chunk = m_chunks[index >> CHUNK_BITS];
+		Slot* c = chunk.load(std::memory_order_relaxed);
+		if (!c) {
+			c = new Slot[CHUNK_SIZE];
+			chunk.store(c, std::memory_order_release);
+		}
+		return c[index & (CHUNK_SIZE - 1)];
+	}
+	Key reserve(Slot& s, size_t index) {
+		s.reserved = true;
+		Key key = static_cast<Key>((s.generation << INDEX_BITS) | Bits(index));
+		//skip generations somebody already registered by hand.
+		while (m_overflowCount.load(std::memory_order_relaxed) != 0 && m_overflow.contains(key)) {
+			s.generation = nextGeneration(s.generation);
+			key = static_cast<Key>((s.generation << INDEX_BITS) | Bits(index));
+		}
+		return key;
+	}
+	static Bits nextGeneration(Bits generation) {
+		return (generation + 1) & (Bits(~Bits(0)) >> INDEX_BITS);
+	}
+	void release(Slot& s, size_t index) {
+		s.generation = nextGeneration(s.generation);
+		m_free.push_back(index);
+	}
+	std::atomic<Slot*> m_chunks[CHUNK_COUNT];
+	std::mutex m_mutex;
+	std::vector<size_t> m_free;
+	size_t m_next;
+	std::atomic<size_t> m_overflowCount;
+	sharded_registry<Key, Value> m_overflow;
+};
+
+//picks the registry ActorManager keeps its actors in. Integer ids of 32 bits or more
+//get the slot array, other keys with std::hash and operator== the sharded hash map and
+//the rest a std::map, which needs operator<. Specialize this to choose something else
+//for a key type.
+template<typename Key, typename Value, typename Enable = void>
+struct actor_registry_policy {
+	typedef ordered_registry<Key, Value> type;
+};
+
+template<typename Key, typename Value>
+struct actor_registry_policy<Key, Value, typename std::enable_if<detail::is_hashable<Key>::value && !(std::is_integral<Key>::value && sizeof(Key) >= 4)>::type> {
+	typedef sharded_registry<Key, Value> type;
+};
+
+template<typename Key, typename Value>
+struct actor_registry_policy<Key, Value, typename std::enable_if<std::is_integral<Key>::value && sizeof(Key) >= 4>::type> {
+	typedef slot_registry<Key, Value> type;
+};
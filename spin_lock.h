@@ -1,18 +1,182 @@
 #pragma once
 #include <atomic>
+#include <thread>
+#include <cstdint>
 #include "design_pattern.h"
+#include "mpsc_queue.h"
+#include "wait_strategy.h"
 
+namespace detail {
+	//exponential backoff between lock attempts, yields once it reaches the cap so a
+	//preempted holder gets the core back.
+	class spin_backoff {
+	public:
+		spin_backoff() : m_spins(1) {}
+		void pause() {
+			if (m_spins > MAX_SPINS) {
+				std::this_thread::yield();
+				return;
+			}
+			for (unsigned int i = 0; i < m_spins; i++) {
+				cpu_relax();
+			}
+			m_spins <<= 1;
+		}
+	private:
+		enum { MAX_SPINS = 1024 };
+		unsigned int m_spins;
+	};
+}
+
+//test-and-test-and-set with exponential backoff. Waiters spin on a shared read of the
+//flag, so the line stays in their caches until the holder releases it. Not fair.
 class spin_lock : public noncopyable {
 public:
-	spin_lock() {
-		flag.clear();
+	spin_lock() : m_locked(false) {}
+	void lock() {
+		detail::spin_backoff backoff;
+		while (m_locked.exchange(true, std::memory_order_acquire)) {
+			do {
+				backoff.pause();
+			} while (m_locked.load(std::memory_order_relaxed));
+		}
+	}
+	bool try_lock() {
+		return !m_locked.load(std::memory_order_relaxed) && !m_locked.exchange(true, std::memory_order_acquire);
 	}
+	void unlock() {
+		m_locked.store(false, std::memory_order_release);
+	}
+private:
+	std::atomic<bool> m_locked;
+};
+
+//FIFO: every waiter takes a ticket and waits for its turn, backing off in proportion
+//to how many are ahead. All waiters still watch one line, fine for a few threads.
+//like every fair lock it convoys when threads outnumber cores: a preempted waiter
+//holds up everybody behind it, waiters yield after a while to keep that short.
+class ticket_lock : public noncopyable {
+public:
+	ticket_lock() : m_next(0), m_serving(0) {}
 	void lock() {
-		while (flag.test_and_set(std::memory_order_acquire));
+		uint32_t ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+		for (unsigned int rounds = 0;; rounds++) {
+			uint32_t serving = m_serving.load(std::memory_order_acquire);
+			if (serving == ticket) {
+				return;
+			}
+			uint32_t ahead = ticket - serving;
+			if (ahead > MAX_AHEAD || rounds > MAX_ROUNDS) {
+				std::this_thread::yield();
+				continue;
+			}
+			for (uint32_t i = 0; i < ahead * SPINS_PER_WAITER; i++) {
+				cpu_relax();
+			}
+		}
+	}
+	bool try_lock() {
+		uint32_t serving = m_serving.load(std::memory_order_acquire);
+		uint32_t next = serving;
+		return m_next.compare_exchange_strong(next, serving + 1, std::memory_order_acquire, std::memory_order_relaxed);
 	}
 	void unlock() {
-		flag.clear(std::memory_order_release);
+		m_serving.store(m_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
 	}
 private:
-	std::atomic_flag flag;
+	enum { SPINS_PER_WAITER = 32, MAX_AHEAD = 16, MAX_ROUNDS = 64 };
+	std::atomic<uint32_t> m_next;
+	std::atomic<uint32_t> m_serving;
+};
+
+//MCS queue lock: FIFO, and every waiter spins on its own queue node, so a release
+//touches exactly one other core. Queue nodes come from a per-thread cache, so a thread
+//may hold any number of mcs_locks at once. Must be unlocked by the locking thread.
+//FIFO too, so the same caveat as ticket_lock applies when threads outnumber cores.
+class mcs_lock : public noncopyable {
+	struct Node {
+		Node() : next(nullptr), locked(false), free(nullptr) {}
+		std::atomic<Node*> next;
+		std::atomic<bool> locked;
+		Node* free;
+		char pad[detail::CACHE_LINE_SIZE - sizeof(std::atomic<Node*>) - sizeof(std::atomic<bool>) - sizeof(Node*)];
+	};
+	struct NodeCache {
+		NodeCache() : head(nullptr) {}
+		~NodeCache() {
+			while (head) {
+				Node* next = head->free;
+				delete head;
+				head = next;
+			}
+		}
+		Node* get() {
+			Node* node = head;
+			if (node) {
+				head = node->free;
+				return node;
+			}
+			return new Node;
+		}
+		void put(Node* node) {
+			node->free = head;
+			head = node;
+		}
+		Node* head;
+	};
+public:
+	mcs_lock() : m_tail(nullptr), m_holder(nullptr) {}
+	void lock() {
+		Node* node = acquireNode();
+		Node* pred = m_tail.exchange(node, std::memory_order_acq_rel);
+		if (pred) {
+			node->locked.store(true, std::memory_order_relaxed);
+			pred->next.store(node, std::memory_order_release);
+			detail::spin_backoff backoff;
+			while (node->locked.load(std::memory_order_acquire)) {
+				backoff.pause();
+			}
+		}
+		m_holder = node;
+	}
+	bool try_lock() {
+		Node* node = acquireNode();
+		Node* expected = nullptr;
+		if (!m_tail.compare_exchange_strong(expected, node, std::memory_order_acquire, std::memory_order_relaxed)) {
+			cache().put(node);
+			return false;
+		}
+		m_holder = node;
+		return true;
+	}
+	void unlock() {
+		Node* node = m_holder;
+		Node* next = node->next.load(std::memory_order_acquire);
+		if (!next) {
+			Node* expected = node;
+			if (m_tail.compare_exchange_strong(expected, nullptr, std::memory_order_release, std::memory_order_relaxed)) {
+				cache().put(node);
+				return;
+			}
+			//a successor swapped itself in but has not linked yet.
+			while (!(next = node->next.load(std::memory_order_acquire))) {
+				cpu_relax();
+			}
+		}
+		next->locked.store(false, std::memory_order_release);
+		cache().put(node);
+	}
+private:
+	static NodeCache& cache() {
+		static thread_local NodeCache c;
+		return c;
+	}
+	static Node* acquireNode() {
+		Node* node = cache().get();
+		node->next.store(nullptr, std::memory_order_relaxed);
+		return node;
+	}
+	std::atomic<Node*> m_tail;
+	//only the holder touches it.
+	Node* m_holder;
 };
@@ -1,95 +1,139 @@
 #pragma once
+#include <time.h>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include "histogram.h"
 #ifdef _WIN32
 #include <Windows.h>
-#include <time.h>
 #pragma comment(lib, "winmm")
+#endif
 
-class Stopwatch {
-public:
-	Stopwatch() {
-		m_isHighResolution = QueryPerformanceFrequency(&m_frequency);
-		m_elapsed = 0;
-		m_running = false;
-	}
-	unsigned long long ElapsedMilliseconds() {
-		return ElapsedTicks() * 1000 / m_frequency.QuadPart;
-	}
-	unsigned long long ElapsedTripMilliseconds() {
-		return ElapsedTripTicks() * 1000 / m_frequency.QuadPart;
-	}
-	bool IsRunning() const {
-		return m_running;
-	}
-
-	static time_t GetTimestamp() {
-		return time(NULL);
-	}
-
-	void Reset() {
-		m_elapsed = 0;
-		QueryPerformanceCounter(&m_start);
-		m_end = m_start;
-	}
-
-	void Restart() {
-		Reset();
-		m_running = true;
-	}
+#if defined(STOPWATCH_USE_TSC) && (defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64))
+#define STOPWATCH_HAS_TSC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#endif
 
-	void Start() {
-		m_running = true;
-		QueryPerformanceCounter(&m_start);
-	}
-	void Stop() {
-		if (m_running) {
-			m_running = false;
-			QueryPerformanceCounter(&m_end);
-			m_elapsed += m_end.QuadPart - m_start.QuadPart;
+namespace detail {
+#ifdef STOPWATCH_HAS_TSC
+	//the time stamp counter read as nanoseconds, calibrated against steady_clock on first use
+	//(takes about 10ms). Only used when the cpu says the counter is invariant, that is it
+	//ticks at the same rate in every core and power state.
+	class tsc_clock {
+	public:
+		static bool available() {
+			static const bool invariant = checkInvariant();
+			return invariant;
 		}
-	}
-private:
-	LARGE_INTEGER m_frequency, m_start, m_end;
-	unsigned long long m_elapsed;
-	BOOL m_isHighResolution;
-	bool m_running;
-
-	unsigned long long ElapsedTicks() {
-		if (m_running) {
-			QueryPerformanceCounter(&m_end);
-			return m_elapsed + m_end.QuadPart - m_start.QuadPart;
+		static uint64_t nanoseconds() {
+			static const Calibration c = calibrate();
+			return static_cast<uint64_t>((__rdtsc() - c.tsc) * c.nsPerTick) + c.ns;
 		}
-		return m_elapsed;
-	}
-	unsigned long long ElapsedTripTicks() {
-		if (m_running) {
-			QueryPerformanceCounter(&m_end);
+	private:
+		struct Calibration {
+			uint64_t tsc;
+			uint64_t ns;
+			double nsPerTick;
+		};
+		static bool checkInvariant() {
+#if defined(_MSC_VER)
+			int regs[4];
+			__cpuid(regs, 0x80000000);
+			if (static_cast<unsigned int>(regs[0]) < 0x80000007) {
+				return false;
+			}
+			__cpuid(regs, 0x80000007);
+			return (regs[3] & (1 << 8)) != 0;
+#else
+			unsigned int eax, ebx, ecx, edx;
+			if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+				return false;
+			}
+			return (edx & (1 << 8)) != 0;
+#endif
 		}
-		return m_end.QuadPart - m_start.QuadPart;
-	}
-};
+		static uint64_t steadyNanoseconds() {
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+		static Calibration calibrate() {
+			Calibration c;
+			c.ns = steadyNanoseconds();
+			c.tsc = __rdtsc();
+			uint64_t ns = c.ns;
+			while (ns - c.ns < 10000000) {
+				ns = steadyNanoseconds();
+			}
+			c.nsPerTick = static_cast<double>(ns - c.ns) / static_cast<double>(__rdtsc() - c.tsc);
+			return c;
+		}
+	};
+#endif
 
+	//monotonic nanoseconds, unaffected by wall clock adjustments.
+	//the counter is used instead with STOPWATCH_USE_TSC defined, where it is invariant.
+	inline uint64_t stopwatch_now() {
+#ifdef STOPWATCH_HAS_TSC
+		if (tsc_clock::available()) {
+			return tsc_clock::nanoseconds();
+		}
+#endif
+#ifdef _WIN32
+		static LARGE_INTEGER frequency = []() {
+			LARGE_INTEGER f;
+			QueryPerformanceFrequency(&f);
+			return f;
+		}();
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		uint64_t ticks = static_cast<uint64_t>(now.QuadPart);
+		uint64_t f = static_cast<uint64_t>(frequency.QuadPart);
+		return ticks / f * 1000000000ULL + ticks % f * 1000000000ULL / f;
+#else
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
 #endif
+	}
+}
 
-#ifdef __GNUC__
-#include <sys/time.h>
+//nanosecond stopwatch. Lap() gives the time since the previous lap and files it in a
+//histogram, which makes it cheap enough to time every single onMessage:
+//	void onMessage(...) override {
+//		w.Lap();
+//		...
+//		w.Lap();
+//	}
+//	printf("%s\n", w.LapSummary().c_str());
+//one thread at a time, like the rest of the stopwatch.
 class Stopwatch {
 public:
-	Stopwatch() {
-		m_elapsed = 0;
-		m_running = false;
-	}
-	unsigned long long ElapsedMilliseconds() {
+	Stopwatch() : m_start(0), m_end(0), m_lap(0), m_elapsed(0), m_running(false) {}
+	unsigned long long ElapsedNanoseconds() {
 		if (m_running) {
-			gettimeofday(&m_end, NULL);
-			return m_elapsed + timevalDiffMilliseconds(m_end, m_start);
+			m_end = detail::stopwatch_now();
+			return m_elapsed + m_end - m_start;
 		}
 		return m_elapsed;
 	}
-	unsigned long long ElapsedTripMilliseconds() {
+	unsigned long long ElapsedMicroseconds() {
+		return ElapsedNanoseconds() / 1000;
+	}
+	unsigned long long ElapsedMilliseconds() {
+		return ElapsedNanoseconds() / 1000000;
+	}
+	//since the last Start, ignoring time accumulated before it.
+	unsigned long long ElapsedTripNanoseconds() {
 		if (m_running) {
-			gettimeofday(&m_end, NULL);
+			m_end = detail::stopwatch_now();
 		}
-		return timevalDiffMilliseconds(m_end, m_start);
+		return m_end - m_start;
+	}
+	unsigned long long ElapsedTripMilliseconds() {
+		return ElapsedTripNanoseconds() / 1000000;
 	}
 	bool IsRunning() const {
 		return m_running;
@@ -101,8 +145,9 @@ public:
 
 	void Reset() {
 		m_elapsed = 0;
-		gettimeofday(&m_start, NULL);
+		m_start = detail::stopwatch_now();
 		m_end = m_start;
+		m_lap = m_start;
 	}
 
 	void Restart() {
@@ -112,21 +157,50 @@ public:
 
 	void Start() {
 		m_running = true;
-		gettimeofday(&m_start, NULL);
+		m_start = detail::stopwatch_now();
+		m_lap = m_start;
 	}
 	void Stop() {
 		if (m_running) {
 			m_running = false;
-			gettimeofday(&m_end, NULL);
-			m_elapsed += timevalDiffMilliseconds(m_end, m_start);
+			m_end = detail::stopwatch_now();
+			m_elapsed += m_end - m_start;
 		}
 	}
-private:
-	static unsigned long long timevalDiffMilliseconds(timeval& e, timeval& s) {
-		return (e.tv_sec - s.tv_sec) * 1000 + (e.tv_usec - s.tv_usec) / 1000;
+	//nanoseconds since the previous Lap, Start or Reset, also recorded in Laps().
+	unsigned long long Lap() {
+		uint64_t now = detail::stopwatch_now();
+		if (m_lap == 0) {
+			//never started, this only sets the mark.
+			m_lap = now;
+			return 0;
+		}
+		uint64_t lap = now - m_lap;
+		m_lap = now;
+		m_laps.record(lap);
+		return lap;
+	}
+	//Lap() without recording it, to skip the time between two measured sections.
+	void SkipLap() {
+		m_lap = detail::stopwatch_now();
 	}
+	const histogram& Laps() const {
+		return m_laps;
+	}
+	void ResetLaps() {
+		m_laps.reset();
+	}
+	//"laps 1000 p50 1.203us p99 3.407us p999 10.111us max 12.000us"
+	std::string LapSummary() const {
+		char buf[160];
+		snprintf(buf, sizeof(buf), "laps %llu p50 %.3fus p99 %.3fus p999 %.3fus max %.3fus",
+			static_cast<unsigned long long>(m_laps.count()), m_laps.percentile(0.5) / 1000.0, m_laps.percentile(0.99) / 1000.0,
+			m_laps.percentile(0.999) / 1000.0, m_laps.maximum() / 1000.0);
+		return buf;
+	}
+private:
+	uint64_t m_start, m_end, m_lap;
 	unsigned long long m_elapsed;
-	timeval m_start, m_end;
 	bool m_running;
+	histogram m_laps;
 };
-#endif
\ No newline at end of file
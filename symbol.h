@@ -0,0 +1,137 @@
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <functional>
+#include <cstdint>
+#include <cstdio>
+#include "design_pattern.h"
+#include "shared_mutex.h"
+#include "br_shared_mutex.h"
+
+namespace detail {
+	//32-bit FNV-1a, usable at compile time.
+	constexpr uint32_t fnv1a(const char* s, uint32_t h = 2166136261u) {
+		return *s ? fnv1a(s + 1, (h ^ uint32_t(static_cast<unsigned char>(*s))) * 16777619u) : h;
+	}
+	inline uint32_t fnv1a(const std::string& s) {
+		uint32_t h = 2166136261u;
+		for (auto it = s.begin(); it != s.end(); ++it) {
+			h = (h ^ uint32_t(static_cast<unsigned char>(*it))) * 16777619u;
+		}
+		return h;
+	}
+}
+
+//hash -> name table, only used to turn a Symbol back into text and to catch collisions.
+class SymbolTable : public noncopyable {
+public:
+	static SymbolTable& inst() {
+		static SymbolTable table;
+		return table;
+	}
+	//throw std::logic_error if another name already owns the hash.
+	uint32_t intern(const std::string& name) {
+		uint32_t value = detail::fnv1a(name);
+		{
+			shared_lock<br_shared_mutex> lck(m_mutex);
+			auto it = m_names.find(value);
+			if (it != m_names.end()) {
+				checkCollision(it->second, name);
+				return value;
+			}
+		}
+		std::lock_guard<br_shared_mutex> lck(m_mutex);
+		auto ret = m_names.insert(std::make_pair(value, name));
+		if (!ret.second) {
+			checkCollision(ret.first->second, name);
+		}
+		return value;
+	}
+	bool lookup(uint32_t value, std::string& name) {
+		shared_lock<br_shared_mutex> lck(m_mutex);
+		auto it = m_names.find(value);
+		if (it == m_names.end()) {
+			return false;
+		}
+		name = it->second;
+		return true;
+	}
+private:
+	SymbolTable() {}
+	static void checkCollision(const std::string& owner, const std::string& name) {
+		if (owner != name) {
+			throw std::logic_error("symbol hash collision: " + owner + " / " + name);
+		}
+	}
+	//interned once, looked up on every name(): readers must not share a cache line.
+	br_shared_mutex m_mutex;
+	std::unordered_map<uint32_t, std::string> m_names;
+};
+
+//32-bit id for actor names and message ids, compared as an integer.
+//a string literal is hashed at compile time and not registered, Symbol::intern,
+//ACTOR_SYMBOL or the std::string constructor register the name so name() can print it.
+//only registered names are checked for collisions: a literal whose hash matches another
+//name is silently the same Symbol. Debug builds therefore register literals as well,
+//which makes them runtime values, define ACTOR_NO_SYMBOL_CHECK to keep them constexpr.
+class Symbol {
+public:
+	constexpr Symbol() : m_value(0) {}
+#if !defined(NDEBUG) && !defined(ACTOR_NO_SYMBOL_CHECK)
+	template<size_t N>
+	Symbol(const char (&literal)[N]) : m_value(SymbolTable::inst().intern(literal)) {}
+#else
+	template<size_t N>
+	constexpr Symbol(const char (&literal)[N]) : m_value(detail::fnv1a(literal)) {}
+#endif
+	Symbol(const std::string& name) : m_value(SymbolTable::inst().intern(name)) {}
+	static Symbol intern(const char* name) {
+		return fromValue(SymbolTable::inst().intern(name));
+	}
+	static constexpr Symbol fromValue(uint32_t value) {
+		return Symbol(value, 0);
+	}
+	constexpr uint32_t value() const {
+		return m_value;
+	}
+	//for logging, "#hash" if the name was never interned.
+	std::string name() const {
+		std::string name;
+		if (!SymbolTable::inst().lookup(m_value, name)) {
+			char buf[16];
+			snprintf(buf, sizeof(buf), "#%08x", m_value);
+			name = buf;
+		}
+		return name;
+	}
+	friend constexpr bool operator==(const Symbol& lhs, const Symbol& rhs) {
+		return lhs.m_value == rhs.m_value;
+	}
+	friend constexpr bool operator!=(const Symbol& lhs, const Symbol& rhs) {
+		return lhs.m_value != rhs.m_value;
+	}
+	friend constexpr bool operator<(const Symbol& lhs, const Symbol& rhs) {
+		return lhs.m_value < rhs.m_value;
+	}
+	friend std::ostream& operator<<(std::ostream& os, const Symbol& sym) {
+		return os << sym.name();
+	}
+private:
+	constexpr Symbol(uint32_t value, int) : m_value(value) {}
+	uint32_t m_value;
+};
+
+//like a literal Symbol, but the name is registered the first time the expression runs.
+#define ACTOR_SYMBOL(literal) ([]() -> Symbol { static const Symbol sym = Symbol::intern(literal); return sym; }())
+
+namespace std {
+	template<>
+	struct hash<Symbol> {
+		size_t operator()(const Symbol& sym) const {
+			return sym.value();
+		}
+	};
+}
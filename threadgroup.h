@@ -4,6 +4,8 @@
 #include <string>
 #include <atomic>
 #include <exception>
+#include <functional>
+#include "wait_strategy.h"
 
 #ifdef LOG4CPP_CATEGORY_NAME
 #include <log4cpp/Category.hh>
@@ -21,6 +23,7 @@ public:
 	{
 		m_done = std::bind([&]{
 			++m_initDone;
+			m_initEvent.notifyAll();
 		});
 	}
 	~ThreadGroup()
@@ -44,6 +47,7 @@ public:
 			log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("TG[%s] T[%s] begin failed, exception[%s].", m_name.c_str(), name, e.what());
 #endif
 			m_initError = true;
+			m_initEvent.notifyAll();
 			return false;
 		}
 	}
@@ -60,12 +64,9 @@ public:
 		}
 		m_Threads.clear();
 	}
-	bool WaitInitDone() const
+	bool WaitInitDone()
 	{
-		while(m_initDone < m_initNeed && !m_initError)
-		{
-			std::this_thread::yield();
-		}
+		WaitStrategy().waitUntil(m_initEvent, [this]() { return m_initDone >= m_initNeed || m_initError; });
 		return !m_initError;
 	}
 private:
@@ -76,9 +77,10 @@ private:
 	};
 	std::vector<Thread*> m_Threads;
 	std::string m_name;
-	volatile bool m_initError;
+	std::atomic<bool> m_initError;
 	std::atomic<int> m_initDone;
 	std::atomic<int> m_initNeed;
+	event_count m_initEvent;
 	InitDone m_done;
 
 	void Runner(Thread* ctx, std::function<void(InitDone)> func)
@@ -104,11 +106,13 @@ private:
 			log4cpp::Category::getInstance(LOG4CPP_CATEGORY_NAME).notice("TG[%s], T[%s] end with exception[%s].", m_name.c_str(), ctx->name.c_str(), e.what());
 #endif
 			m_initError = true;
+			m_initEvent.notifyAll();
 			return;
 		}
 		catch(...)
 		{
 			m_initError = true;
+			m_initEvent.notifyAll();
 			return;
 		}
 #ifdef LOG4CPP_CATEGORY_NAME
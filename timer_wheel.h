@@ -0,0 +1,379 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+#include <new>
+#include <cstdint>
+#include "design_pattern.h"
+#include "spin_lock.h"
+#include "mpsc_queue.h"
+
+//hierarchical timing wheel (Varghese & Lauck) driven by its own timer thread.
+//4 levels of 256 slots with a 1ms tick cover 2^32 ms, later deadlines are parked on the
+//last level and re-inserted when it cascades. add() and cancel() are O(1) and never wait
+//for the timer thread: new timers reach it through an MPSC queue, a cancel flips the
+//timer's state and, if the timer is already in the wheel, queues it for unlinking.
+//everything that is due in one wakeup goes to the fire callback as one batch.
+template<typename Payload>
+class timer_wheel : public noncopyable {
+	enum {
+		LEVELS = 4,
+		SLOT_BITS = 8,
+		SLOTS = 1 << SLOT_BITS,
+		SLOT_MASK = SLOTS - 1,
+		CHUNK_NODES = 1024,
+		MAX_CHUNKS = 16384
+	};
+	enum STATE {
+		E_TS_FREE,
+		E_TS_PENDING,
+		E_TS_ARMED,
+		E_TS_FIRING,
+		E_TS_CANCELLED
+	};
+	struct Node : public detail::mpsc_node {
+		Node() : prevTimer(nullptr), nextTimer(nullptr), expire(0), period(0), stamp(uint64_t(1) << 32), index(0), level(0), slot(0), linked(false) {}
+		//the wheel fields below are only touched by the timer thread.
+		Node* prevTimer;
+		Node* nextTimer;
+		uint64_t expire;
+		uint64_t period;
+		//generation << 32 | STATE, the generation makes stale ids harmless.
+		std::atomic<uint64_t> stamp;
+		uint32_t index;
+		uint8_t level;
+		uint16_t slot;
+		bool linked;
+		Payload payload;
+	};
+public:
+	typedef uint64_t timer_id;
+	typedef std::function<void(std::vector<Payload*>&)> fire_callback;
+	explicit timer_wheel(const fire_callback& fire)
+		: m_fire(fire), m_start(std::chrono::steady_clock::now()), m_now(0), m_pending(0), m_chunkCount(0), m_exit(false), m_kicked(false), m_wakeAt(UINT64_MAX) {
+		for (int i = 0; i < LEVELS; i++) {
+			for (int j = 0; j < SLOTS; j++) {
+				m_wheel[i][j] = nullptr;
+			}
+			for (int j = 0; j < SLOTS / 64; j++) {
+				m_bitmap[i][j] = 0;
+			}
+		}
+		for (size_t i = 0; i < MAX_CHUNKS; i++) {
+			m_chunks[i].store(nullptr, std::memory_order_relaxed);
+		}
+		m_thread = std::thread(&timer_wheel::run, this);
+	}
+	~timer_wheel() {
+		stop();
+		//timers that never fired take their payloads with them.
+		for (size_t i = 0; i < m_chunkCount; i++) {
+			delete[] m_chunks[i].load(std::memory_order_relaxed);
+		}
+	}
+	//nothing fires after this returns, add() and cancel() are still safe to call.
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lck(m_mutex);
+			m_exit = true;
+			m_cv.notify_one();
+		}
+		if (m_thread.joinable()) {
+			m_thread.join();
+		}
+	}
+	//period 0 fires once. The returned id is never 0.
+	timer_id add(uint64_t delayMs, uint64_t periodMs, Payload&& payload) {
+		Node* node = allocate();
+		node->payload = std::move(payload);
+		node->period = periodMs;
+		uint64_t expire = elapsed() + delayMs;
+		node->expire = expire;
+		uint64_t gen = node->stamp.load(std::memory_order_relaxed) >> 32;
+		node->stamp.store((gen << 32) | E_TS_PENDING, std::memory_order_release);
+		//the node belongs to the timer thread from here on.
+		m_requests.push(node);
+		//pairs with the fence in run(), either we see its new m_wakeAt or it sees our node.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (expire < m_wakeAt.load(std::memory_order_relaxed)) {
+			kick();
+		}
+		return (gen << 32) | node->index;
+	}
+	//false if the timer already fired (one-shot), was cancelled, or never existed.
+	//a periodic timer that is being delivered right now fires this last time.
+	bool cancel(timer_id id) {
+		uint32_t index = static_cast<uint32_t>(id);
+		if (index / CHUNK_NODES >= MAX_CHUNKS) {
+			return false;
+		}
+		Node* chunk = m_chunks[index / CHUNK_NODES].load(std::memory_order_acquire);
+		if (!chunk) {
+			return false;
+		}
+		Node* node = &chunk[index % CHUNK_NODES];
+		uint64_t gen = id >> 32;
+		uint64_t stamp = node->stamp.load(std::memory_order_acquire);
+		for (;;) {
+			if ((stamp >> 32) != gen) {
+				return false;
+			}
+			STATE state = static_cast<STATE>(stamp & 0xff);
+			if (state != E_TS_PENDING && state != E_TS_ARMED && state != E_TS_FIRING) {
+				return false;
+			}
+			if (node->stamp.compare_exchange_weak(stamp, (gen << 32) | E_TS_CANCELLED, std::memory_order_acq_rel)) {
+				//a pending timer is still queued and a firing one is held by the thread,
+				//only one sitting in the wheel needs unlinking. No hurry for that, the
+				//thread wakes up at least every 256 ticks while the wheel is not empty.
+				if (state == E_TS_ARMED) {
+					m_requests.push(node);
+				}
+				return true;
+			}
+		}
+	}
+	//timers linked into the wheel, as last seen by the timer thread.
+	size_t pending() const {
+		return m_pending.load(std::memory_order_relaxed);
+	}
+private:
+	uint64_t elapsed() const {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count());
+	}
+	void kick() {
+		std::lock_guard<std::mutex> lck(m_mutex);
+		m_kicked = true;
+		m_cv.notify_one();
+	}
+	Node* allocate() {
+		std::lock_guard<spin_lock> lck(m_poolLock);
+		if (m_free.empty()) {
+			if (m_chunkCount == MAX_CHUNKS) {
+				throw std::bad_alloc();
+			}
+			Node* chunk = new Node[CHUNK_NODES];
+			uint32_t base = static_cast<uint32_t>(m_chunkCount * CHUNK_NODES);
+			for (uint32_t i = CHUNK_NODES; i > 0; --i) {
+				chunk[i - 1].index = base + i - 1;
+				m_free.push_back(&chunk[i - 1]);
+			}
+			m_chunks[m_chunkCount++].store(chunk, std::memory_order_release);
+		}
+		Node* node = m_free.back();
+		m_free.pop_back();
+		return node;
+	}
+	void release(Node* node) {
+		node->payload = Payload();
+		uint64_t gen = (node->stamp.load(std::memory_order_relaxed) >> 32) + 1;
+		if ((gen & 0xffffffff) == 0) {
+			gen = 1;
+		}
+		node->stamp.store((gen << 32) | E_TS_FREE, std::memory_order_release);
+		std::lock_guard<spin_lock> lck(m_poolLock);
+		m_free.push_back(node);
+	}
+	static STATE state(const Node* node) {
+		return static_cast<STATE>(node->stamp.load(std::memory_order_acquire) & 0xff);
+	}
+	//change the state keeping the generation, fails if a cancel got there first.
+	static bool transit(Node* node, STATE from, STATE to) {
+		uint64_t stamp = node->stamp.load(std::memory_order_acquire);
+		if ((stamp & 0xff) != uint64_t(from)) {
+			return false;
+		}
+		return node->stamp.compare_exchange_strong(stamp, (stamp & ~uint64_t(0xff)) | to, std::memory_order_acq_rel);
+	}
+	void link(Node* node) {
+		uint64_t at = node->expire > m_now ? node->expire : m_now + 1;
+		uint64_t delta = at - m_now;
+		if (delta >= (uint64_t(1) << (SLOT_BITS * LEVELS))) {
+			at = m_now + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+			delta = at - m_now;
+		}
+		int level = 0;
+		while (delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+			++level;
+		}
+		size_t slot = static_cast<size_t>((at >> (SLOT_BITS * level)) & SLOT_MASK);
+		Node*& head = m_wheel[level][slot];
+		node->prevTimer = nullptr;
+		node->nextTimer = head;
+		if (head) {
+			head->prevTimer = node;
+		}
+		head = node;
+		node->level = static_cast<uint8_t>(level);
+		node->slot = static_cast<uint16_t>(slot);
+		node->linked = true;
+		m_bitmap[level][slot / 64] |= uint64_t(1) << (slot % 64);
+		m_pending.fetch_add(1, std::memory_order_relaxed);
+	}
+	void unlink(Node* node) {
+		Node*& head = m_wheel[node->level][node->slot];
+		if (node->prevTimer) {
+			node->prevTimer->nextTimer = node->nextTimer;
+		}
+		else {
+			head = node->nextTimer;
+		}
+		if (node->nextTimer) {
+			node->nextTimer->prevTimer = node->prevTimer;
+		}
+		if (!head) {
+			m_bitmap[node->level][node->slot / 64] &= ~(uint64_t(1) << (node->slot % 64));
+		}
+		node->prevTimer = node->nextTimer = nullptr;
+		node->linked = false;
+		m_pending.fetch_sub(1, std::memory_order_relaxed);
+	}
+	//new timers and cancels.
+	void drainRequests() {
+		while (Node* node = m_requests.try_pop()) {
+			if (node->linked) {
+				//cancelled while in the wheel.
+				unlink(node);
+				release(node);
+			}
+			else if (transit(node, E_TS_PENDING, E_TS_ARMED)) {
+				link(node);
+			}
+			else if (state(node) == E_TS_CANCELLED) {
+				//cancelled before we saw it, or unlinked by expire() already.
+				release(node);
+			}
+		}
+	}
+	//move everything in a higher level slot down to where it belongs now.
+	void cascade(int level) {
+		size_t slot = static_cast<size_t>((m_now >> (SLOT_BITS * level)) & SLOT_MASK);
+		Node* node = m_wheel[level][slot];
+		while (node) {
+			Node* next = node->nextTimer;
+			unlink(node);
+			link(node);
+			node = next;
+		}
+	}
+	void expire(std::vector<Node*>& due) {
+		Node* node = m_wheel[0][m_now & SLOT_MASK];
+		while (node) {
+			Node* next = node->nextTimer;
+			if (node->expire <= m_now) {
+				unlink(node);
+				//a cancelled one is freed when its cancel request comes through.
+				if (transit(node, E_TS_ARMED, E_TS_FIRING)) {
+					due.push_back(node);
+				}
+			}
+			node = next;
+		}
+	}
+	void advance(uint64_t target, std::vector<Node*>& due) {
+		if (m_pending.load(std::memory_order_relaxed) == 0 && target > m_now) {
+			m_now = target;
+			return;
+		}
+		while (m_now < target) {
+			++m_now;
+			if ((m_now & SLOT_MASK) == 0) {
+				int top = 1;
+				while (top < LEVELS - 1 && ((m_now >> (SLOT_BITS * top)) & SLOT_MASK) == 0) {
+					++top;
+				}
+				for (int level = top; level > 0; --level) {
+					cascade(level);
+				}
+			}
+			expire(due);
+		}
+	}
+	//the next tick with something to do: a busy level 0 slot or the next cascade.
+	uint64_t nextTick() const {
+		if (m_pending.load(std::memory_order_relaxed) == 0) {
+			return UINT64_MAX;
+		}
+		size_t from = static_cast<size_t>(m_now & SLOT_MASK) + 1;
+		for (size_t slot = from; slot < SLOTS; slot++) {
+			if (m_bitmap[0][slot / 64] & (uint64_t(1) << (slot % 64))) {
+				return (m_now & ~uint64_t(SLOT_MASK)) + slot;
+			}
+		}
+		return (m_now | SLOT_MASK) + 1;
+	}
+	void fire(std::vector<Node*>& due, std::vector<Payload*>& batch) {
+		for (auto it = due.begin(); it != due.end(); ++it) {
+			batch.push_back(&(*it)->payload);
+		}
+		m_fire(batch);
+		batch.clear();
+		for (auto it = due.begin(); it != due.end(); ++it) {
+			Node* node = *it;
+			if (node->period != 0 && transit(node, E_TS_FIRING, E_TS_ARMED)) {
+				//fixed rate, but never more than one catch-up per period.
+				node->expire += node->period;
+				if (node->expire <= m_now) {
+					node->expire = m_now + node->period;
+				}
+				link(node);
+			}
+			else {
+				release(node);
+			}
+		}
+		due.clear();
+	}
+	void run() {
+		std::vector<Node*> due;
+		std::vector<Payload*> batch;
+		for (;;) {
+			drainRequests();
+			advance(elapsed(), due);
+			if (!due.empty()) {
+				fire(due, batch);
+				continue;
+			}
+			uint64_t next = nextTick();
+			m_wakeAt.store(next, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!m_requests.empty()) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lck(m_mutex);
+			if (next == UINT64_MAX) {
+				m_cv.wait(lck, [this]() { return m_kicked || m_exit; });
+			}
+			else {
+				m_cv.wait_until(lck, m_start + std::chrono::milliseconds(next), [this]() { return m_kicked || m_exit; });
+			}
+			m_kicked = false;
+			if (m_exit) {
+				break;
+			}
+			m_wakeAt.store(0, std::memory_order_relaxed);
+		}
+	}
+	fire_callback m_fire;
+	std::chrono::steady_clock::time_point m_start;
+	//timer thread only.
+	uint64_t m_now;
+	Node* m_wheel[LEVELS][SLOTS];
+	uint64_t m_bitmap[LEVELS][SLOTS / 64];
+	std::atomic<size_t> m_pending;
+	intrusive_mpsc_queue<Node> m_requests;
+	spin_lock m_poolLock;
+	std::atomic<Node*> m_chunks[MAX_CHUNKS];
+	size_t m_chunkCount;
+	std::vector<Node*> m_free;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_exit;
+	bool m_kicked;
+	std::atomic<uint64_t> m_wakeAt;
+	std::thread m_thread;
+};
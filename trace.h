@@ -0,0 +1,473 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <ostream>
+#include <fstream>
+#include <type_traits>
+#include <cstdint>
+#include <cstdio>
+#include "design_pattern.h"
+#include "actor_metrics.h"
+
+//where a traced message is.
+enum TRACE_EVENT
+{
+	//ActorManager::sendMessage / ask, before the target is looked up.
+	E_TE_SEND,
+	//handed to the target's mailbox.
+	E_TE_ENQUEUE,
+	//taken out by the actor's thread or Poll().
+	E_TE_DEQUEUE,
+	//onMessageBatch returned, once per batch that held a traced message.
+	E_TE_HANDLED
+};
+
+namespace detail {
+	template<typename T>
+	class is_streamable {
+		template<typename U>
+		static auto test(int) -> decltype(std::declval<std::ostream&>() << std::declval<const U&>(), std::true_type());
+		template<typename>
+		static std::false_type test(...);
+	public:
+		static const bool value = decltype(test<T>(0))::value;
+	};
+
+	template<typename T>
+	typename std::enable_if<is_streamable<T>::value, std::string>::type trace_name(const T& id, uint32_t) {
+		std::ostringstream ss;
+		ss << id;
+		return ss.str();
+	}
+	template<typename T>
+	typename std::enable_if<!is_streamable<T>::value, std::string>::type trace_name(const T&, uint32_t serial) {
+		std::ostringstream ss;
+		ss << "actor-" << serial;
+		return ss.str();
+	}
+}
+
+//sampled message lifecycle tracing, off until start(). Every thread writes its own ring,
+//the last ringSize records survive, older ones are overwritten. While stopped a send
+//costs one relaxed load. Define ACTOR_NO_TRACE to compile it out.
+//the ring of an exited thread keeps its events until a new thread takes the ring over,
+//so memory follows the most threads tracing at once, not every thread that ever traced.
+//a message's Message::traceId says whether it is traced: 0 not decided yet, 1 skipped
+//by sampling, anything else is its flow id.
+class message_tracer : public noncopyable {
+	struct Record {
+		std::atomic<uint64_t> ts;
+		std::atomic<uint64_t> flow;
+		//actor serial << 8 | TRACE_EVENT.
+		std::atomic<uint64_t> what;
+	};
+	//written by its thread only, read by the exporter at any time.
+	struct Ring {
+		Ring(size_t size, uint32_t index_, const std::string& name_) : records(new Record[size]), mask(size - 1), head(0), index(index_), name(name_), inUse(true), sampled(0), flows(0) {}
+		~Ring() {
+			delete[] records;
+		}
+		void push(TRACE_EVENT event, uint64_t ts, uint64_t flow, uint32_t actor) {
+			uint64_t h = head.load(std::memory_order_relaxed);
+			Record& r = records[h & mask];
+			r.ts.store(ts, std::memory_order_relaxed);
+			r.flow.store(flow, std::memory_order_relaxed);
+			r.what.store((uint64_t(actor) << 8) | event, std::memory_order_relaxed);
+			head.store(h + 1, std::memory_order_release);
+		}
+		Record* records;
+		size_t mask;
+		std::atomic<uint64_t> head;
+		uint32_t index;
+		std::string name;
+		//false once the thread exited. records, mask, index and name only change under
+		//m_mutex while it is false.
+		std::atomic<bool> inUse;
+		//owner thread only.
+		unsigned int sampled;
+		uint64_t flows;
+	};
+public:
+	enum { E_TRACE_UNDECIDED = 0, E_TRACE_SKIPPED = 1 };
+	//per actor: a serial that never gets reused, named the first time it shows up in a trace.
+	class ActorTag : public noncopyable {
+	public:
+		ActorTag() : m_serial(message_tracer::global().m_nextActor.fetch_add(1, std::memory_order_relaxed)), m_named(false) {}
+		template<typename Id>
+		uint32_t get(const Id& id) {
+			if (!m_named.load(std::memory_order_relaxed) && !m_named.exchange(true)) {
+				message_tracer::global().nameActor(m_serial, detail::trace_name(id, m_serial));
+			}
+			return m_serial;
+		}
+		uint32_t serial() const {
+			return m_serial;
+		}
+	private:
+		uint32_t m_serial;
+		std::atomic<bool> m_named;
+	};
+	static message_tracer& global() {
+		static message_tracer tracer;
+		return tracer;
+	}
+	//trace one message in every sampleEvery. ringSize records per thread, a power of two,
+	//only threads that have no ring yet get the new size.
+	void start(unsigned int sampleEvery = 1, size_t ringSize = 16384) {
+		size_t n = 2;
+		while (n < ringSize) {
+			n <<= 1;
+		}
+		m_ringSize.store(n, std::memory_order_relaxed);
+		m_sampleEvery.store(sampleEvery == 0 ? 1 : sampleEvery, std::memory_order_relaxed);
+		m_enabled.store(true, std::memory_order_release);
+	}
+	void stop() {
+		m_enabled.store(false, std::memory_order_release);
+	}
+	bool enabled() const {
+#ifndef ACTOR_NO_TRACE
+		return m_enabled.load(std::memory_order_relaxed);
+#else
+		return false;
+#endif
+	}
+	//shown instead of thread-N for the calling thread.
+	static void nameThread(const std::string& name) {
+		threadName() = name;
+		if (Ring* ring = threadRing().ring) {
+			std::lock_guard<std::mutex> lck(global().m_mutex);
+			ring->name = name;
+		}
+	}
+	//ActorManager::sendMessage: decides whether msg is traced.
+	template<typename Message>
+	void sent(Message& msg) {
+		if (!enabled()) {
+			return;
+		}
+		Ring* ring = ownRing();
+		msg.traceId = sample(ring);
+		if (msg.traceId != E_TRACE_SKIPPED) {
+			ring->push(E_TE_SEND, ActorMetrics::now(), msg.traceId, 0);
+		}
+	}
+	//msg is about to go into the mailbox of actor id, messages that bypassed sendMessage
+	//are sampled here.
+	template<typename Message, typename Id>
+	void enqueued(Message& msg, ActorTag& tag, const Id& id) {
+		if (!enabled()) {
+			return;
+		}
+		uint32_t actor = tag.get(id);
+		Ring* ring = ownRing();
+		if (msg.traceId == E_TRACE_UNDECIDED) {
+			msg.traceId = sample(ring);
+		}
+		if (msg.traceId != E_TRACE_SKIPPED) {
+			ring->push(E_TE_ENQUEUE, ActorMetrics::now(), msg.traceId, actor);
+		}
+	}
+	//the actor took batch, true if any of it is traced: then call handled() after it ran.
+	template<typename Batch, typename Id>
+	bool dequeued(const Batch& batch, ActorTag& tag, const Id& id) {
+		if (!enabled()) {
+			return false;
+		}
+		uint32_t actor = tag.get(id);
+		Ring* ring = nullptr;
+		uint64_t ts = 0;
+		for (auto it = batch.begin(); it != batch.end(); ++it) {
+			uint64_t flow = (*it)->traceId;
+			if (flow > E_TRACE_SKIPPED) {
+				if (!ring) {
+					ring = ownRing();
+					ts = ActorMetrics::now();
+				}
+				ring->push(E_TE_DEQUEUE, ts, flow, actor);
+			}
+		}
+		return ring != nullptr;
+	}
+	void handled(const ActorTag& tag) {
+		ownRing()->push(E_TE_HANDLED, ActorMetrics::now(), 0, tag.serial());
+	}
+	//Chrome trace JSON of everything still in the rings, for chrome://tracing or Perfetto.
+	//one track per thread: sends as slices on the sending thread, handler batches named
+	//after the actor on the thread that ran them, an arrow from each send to its batch,
+	//and the time every message spent queued on a track per actor.
+	//safe while tracing goes on, records overwritten meanwhile are left out.
+	void exportChromeTrace(std::ostream& os) {
+		std::vector<Track> rings;
+		std::map<uint32_t, std::string> actors;
+		{
+			//a ring may change owner afterwards, take everything about it now.
+			std::lock_guard<std::mutex> lck(m_mutex);
+			for (auto it = m_rings.begin(); it != m_rings.end(); ++it) {
+				Track track;
+				track.index = (*it)->index;
+				track.name = (*it)->name;
+				track.events = snapshot(**it);
+				rings.push_back(std::move(track));
+			}
+			actors = m_actors;
+		}
+		uint64_t base = UINT64_MAX;
+		for (auto it = rings.begin(); it != rings.end(); ++it) {
+			for (auto e = it->events.begin(); e != it->events.end(); ++e) {
+				if (e->ts < base) {
+					base = e->ts;
+				}
+			}
+		}
+		//where every flow was enqueued, to measure its time in the mailbox, and which ones
+		//went through sendMessage. Both happen on the sending thread.
+		std::map<uint64_t, const Event*> enqueues;
+		std::map<uint64_t, const Event*> sends;
+		for (auto it = rings.begin(); it != rings.end(); ++it) {
+			for (auto e = it->events.begin(); e != it->events.end(); ++e) {
+				if (e->event == E_TE_ENQUEUE) {
+					enqueues[e->flow] = &*e;
+				}
+				else if (e->event == E_TE_SEND) {
+					sends[e->flow] = &*e;
+				}
+			}
+		}
+		os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+		bool first = true;
+		for (auto it = rings.begin(); it != rings.end(); ++it) {
+			emit(os, first) << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << it->index << ",\"args\":{\"name\":" << quote(it->name) << "}}";
+		}
+		for (auto it = rings.begin(); it != rings.end(); ++it) {
+			uint32_t tid = it->index;
+			const std::vector<Event>& events = it->events;
+			//dequeues of the batch that is running, per actor.
+			std::map<uint32_t, std::vector<const Event*>> running;
+			for (auto it2 = events.begin(); it2 != events.end(); ++it2) {
+				const Event& e = *it2;
+				if (e.event == E_TE_SEND) {
+					//ends at the enqueue, no enqueue: the target was not found.
+					uint64_t end = e.ts;
+					uint32_t target = 0;
+					auto q = enqueues.find(e.flow);
+					if (q != enqueues.end()) {
+						end = q->second->ts;
+						target = q->second->actor;
+					}
+					emit(os, first) << "{\"ph\":\"X\",\"cat\":\"send\",\"name\":" << quote("send " + actorName(actors, target)) << ",\"pid\":1,\"tid\":" << tid
+						<< ",\"ts\":" << micros(e.ts - base) << ",\"dur\":" << micros(end - e.ts) << "}";
+					emit(os, first) << "{\"ph\":\"s\",\"cat\":\"message\",\"name\":\"message\",\"id\":" << e.flow << ",\"pid\":1,\"tid\":" << tid << ",\"ts\":" << micros(e.ts - base) << "}";
+				}
+				else if (e.event == E_TE_ENQUEUE) {
+					if (sends.find(e.flow) == sends.end()) {
+						emit(os, first) << "{\"ph\":\"s\",\"cat\":\"message\",\"name\":\"message\",\"id\":" << e.flow << ",\"pid\":1,\"tid\":" << tid << ",\"ts\":" << micros(e.ts - base) << "}";
+					}
+				}
+				else if (e.event == E_TE_DEQUEUE) {
+					running[e.actor].push_back(&e);
+				}
+				else if (e.event == E_TE_HANDLED) {
+					std::vector<const Event*>& batch = running[e.actor];
+					if (batch.empty()) {
+						continue;
+					}
+					uint64_t begin = batch.front()->ts;
+					std::string actor = actorName(actors, e.actor);
+					emit(os, first) << "{\"ph\":\"X\",\"cat\":\"handler\",\"name\":" << quote(actor) << ",\"pid\":1,\"tid\":" << tid
+						<< ",\"ts\":" << micros(begin - base) << ",\"dur\":" << micros(e.ts - begin) << ",\"args\":{\"messages\":" << batch.size() << "}}";
+					for (auto d = batch.begin(); d != batch.end(); ++d) {
+						uint64_t flow = (*d)->flow;
+						emit(os, first) << "{\"ph\":\"f\",\"bp\":\"e\",\"cat\":\"message\",\"name\":\"message\",\"id\":" << flow << ",\"pid\":1,\"tid\":" << tid << ",\"ts\":" << micros(begin - base) << "}";
+						auto q = enqueues.find(flow);
+						if (q != enqueues.end() && q->second->ts <= begin) {
+							emit(os, first) << "{\"ph\":\"b\",\"cat\":\"queue\",\"name\":" << quote("queued " + actor) << ",\"id\":" << flow << ",\"pid\":1,\"tid\":" << tid << ",\"ts\":" << micros(q->second->ts - base) << "}";
+							emit(os, first) << "{\"ph\":\"e\",\"cat\":\"queue\",\"name\":" << quote("queued " + actor) << ",\"id\":" << flow << ",\"pid\":1,\"tid\":" << tid << ",\"ts\":" << micros(begin - base) << "}";
+						}
+					}
+					batch.clear();
+				}
+			}
+		}
+		os << "\n]}\n";
+	}
+	bool exportChromeTrace(const std::string& path) {
+		std::ofstream file(path.c_str());
+		if (!file) {
+			return false;
+		}
+		exportChromeTrace(file);
+		return static_cast<bool>(file);
+	}
+	//drop every recorded event.
+	void clear() {
+		std::lock_guard<std::mutex> lck(m_mutex);
+		for (auto it = m_rings.begin(); it != m_rings.end(); ++it) {
+			(*it)->head.store(0, std::memory_order_relaxed);
+		}
+	}
+private:
+	struct Event {
+		uint64_t ts;
+		uint64_t flow;
+		uint32_t actor;
+		TRACE_EVENT event;
+	};
+	//one thread's events as exported.
+	struct Track {
+		uint32_t index;
+		std::string name;
+		std::vector<Event> events;
+	};
+	//the ring goes back to the tracer when the thread exits.
+	struct ThreadRing {
+		ThreadRing() : ring(nullptr) {}
+		~ThreadRing() {
+			if (ring) {
+				ring->inUse.store(false, std::memory_order_release);
+			}
+		}
+		Ring* ring;
+	};
+	message_tracer() : m_enabled(false), m_sampleEvery(1), m_ringSize(16384), m_nextActor(1), m_nextIndex(1) {}
+	Ring* ownRing() {
+		ThreadRing& tls = threadRing();
+		if (!tls.ring) {
+			tls.ring = acquire();
+		}
+		return tls.ring;
+	}
+	//takes over the ring of an exited thread before allocating a new one. A taken over
+	//ring gets a fresh index, so its flow ids and track never mix with the old thread's.
+	Ring* acquire() {
+		std::lock_guard<std::mutex> lck(m_mutex);
+		size_t size = m_ringSize.load(std::memory_order_relaxed);
+		uint32_t index = m_nextIndex++;
+		std::string name = threadName();
+		if (name.empty()) {
+			std::ostringstream ss;
+			ss << "thread-" << index;
+			name = ss.str();
+		}
+		for (auto it = m_rings.begin(); it != m_rings.end(); ++it) {
+			Ring* ring = it->get();
+			if (ring->inUse.load(std::memory_order_acquire)) {
+				continue;
+			}
+			if (ring->mask + 1 != size) {
+				delete[] ring->records;
+				ring->records = new Record[size];
+				ring->mask = size - 1;
+			}
+			ring->head.store(0, std::memory_order_relaxed);
+			ring->index = index;
+			ring->name = name;
+			ring->sampled = 0;
+			ring->flows = 0;
+			ring->inUse.store(true, std::memory_order_relaxed);
+			return ring;
+		}
+		m_rings.push_back(std::unique_ptr<Ring>(new Ring(size, index, name)));
+		return m_rings.back().get();
+	}
+	//every sampleEvery-th message of this thread, flow ids are unique per thread.
+	uint64_t sample(Ring* ring) {
+		if (++ring->sampled < m_sampleEvery.load(std::memory_order_relaxed)) {
+			return E_TRACE_SKIPPED;
+		}
+		ring->sampled = 0;
+		return (uint64_t(ring->index) << 40) | ++ring->flows;
+	}
+	void nameActor(uint32_t serial, const std::string& name) {
+		std::lock_guard<std::mutex> lck(m_mutex);
+		m_actors[serial] = name;
+	}
+	static std::vector<Event> snapshot(const Ring& ring) {
+		std::vector<Event> events;
+		uint64_t size = ring.mask + 1;
+		uint64_t head = ring.head.load(std::memory_order_acquire);
+		uint64_t begin = head > size ? head - size : 0;
+		for (uint64_t i = begin; i < head; i++) {
+			const Record& r = ring.records[i & ring.mask];
+			Event e;
+			e.ts = r.ts.load(std::memory_order_relaxed);
+			e.flow = r.flow.load(std::memory_order_relaxed);
+			uint64_t what = r.what.load(std::memory_order_relaxed);
+			e.actor = static_cast<uint32_t>(what >> 8);
+			e.event = static_cast<TRACE_EVENT>(what & 0xff);
+			events.push_back(e);
+		}
+		//the owner kept writing, whatever it wrapped over while we read is garbage.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t now = ring.head.load(std::memory_order_relaxed);
+		if (now > begin + size) {
+			uint64_t lost = now - (begin + size);
+			events.erase(events.begin(), events.begin() + static_cast<size_t>(lost < events.size() ? lost : events.size()));
+		}
+		return events;
+	}
+	static std::string actorName(const std::map<uint32_t, std::string>& actors, uint32_t serial) {
+		auto it = actors.find(serial);
+		if (it != actors.end()) {
+			return it->second;
+		}
+		std::ostringstream ss;
+		ss << "actor-" << serial;
+		return ss.str();
+	}
+	static std::ostream& emit(std::ostream& os, bool& first) {
+		if (!first) {
+			os << ",\n";
+		}
+		first = false;
+		return os;
+	}
+	static std::string micros(uint64_t ns) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%llu.%03u", static_cast<unsigned long long>(ns / 1000), static_cast<unsigned int>(ns % 1000));
+		return buf;
+	}
+	static std::string quote(const std::string& s) {
+		std::string out("\"");
+		for (size_t i = 0; i < s.size(); i++) {
+			unsigned char c = static_cast<unsigned char>(s[i]);
+			if (c == '"' || c == '\\') {
+				out += '\\';
+				out += static_cast<char>(c);
+			}
+			else if (c < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				out += buf;
+			}
+			else {
+				out += static_cast<char>(c);
+			}
+		}
+		return out + "\"";
+	}
+	static ThreadRing& threadRing() {
+		static thread_local ThreadRing ring;
+		return ring;
+	}
+	static std::string& threadName() {
+		static thread_local std::string name;
+		return name;
+	}
+	std::atomic<bool> m_enabled;
+	std::atomic<unsigned int> m_sampleEvery;
+	std::atomic<size_t> m_ringSize;
+	std::atomic<uint32_t> m_nextActor;
+	//guards m_rings, what a ring may change under it, m_nextIndex and m_actors.
+	std::mutex m_mutex;
+	uint32_t m_nextIndex;
+	//a ring outlives its thread so its events can still be exported, until acquire()
+	//hands it to a new thread.
+	std::vector<std::unique_ptr<Ring>> m_rings;
+	std::map<uint32_t, std::string> m_actors;
+};
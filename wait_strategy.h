@@ -0,0 +1,149 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include "design_pattern.h"
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <mutex>
+#include <condition_variable>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//tell the core we are spinning: frees the pipeline for the sibling hyperthread
+//and avoids the memory order flush when the awaited store shows up.
+inline void cpu_relax() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+//lets a thread sleep until "something changed" without holding a lock around the condition.
+//the waiter takes a key, re-checks its condition and then waits on the key, a notify after
+//the key was taken always ends the wait. Notifying with nobody waiting is a single load.
+//futex based on Linux, a mutex and condition variable elsewhere.
+class event_count : public noncopyable {
+public:
+	event_count() : m_epoch(0), m_waiters(0) {}
+	uint32_t prepareWait() {
+		m_waiters.fetch_add(1);
+		return m_epoch.load();
+	}
+	void cancelWait() {
+		m_waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+	void wait(uint32_t key) {
+#if defined(__linux__)
+		while (m_epoch.load(std::memory_order_acquire) == key) {
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_epoch), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+		}
+#else
+		std::unique_lock<std::mutex> lck(m_mutex);
+		while (m_epoch.load(std::memory_order_acquire) == key) {
+			m_cv.wait(lck);
+		}
+#endif
+		m_waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+	//the caller changed the condition before, with a seq_cst operation.
+	void notifyOne() {
+		if (m_waiters.load() != 0) {
+			m_epoch.fetch_add(1);
+			wake(1);
+		}
+	}
+	void notifyAll() {
+		if (m_waiters.load() != 0) {
+			m_epoch.fetch_add(1);
+			wake(INT32_MAX);
+		}
+	}
+private:
+	void wake(int count) {
+#if defined(__linux__)
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_epoch), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+		{
+			std::lock_guard<std::mutex> lck(m_mutex);
+		}
+		if (count == 1) {
+			m_cv.notify_one();
+		}
+		else {
+			m_cv.notify_all();
+		}
+#endif
+	}
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be a plain 32-bit integer");
+	std::atomic<uint32_t> m_epoch;
+	std::atomic<uint32_t> m_waiters;
+#if !defined(__linux__)
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+#endif
+};
+
+//how an idle thread waits: spins pause iterations, then yields time slices, then parks.
+//spinning trades a core for wake up latency: a low latency actor spins, a background
+//one parks right away. Set per actor through MailboxOptions::wait, for the pool
+//workers through the ActorManager constructor.
+struct WaitStrategy
+{
+	WaitStrategy(unsigned int spins_ = 64, unsigned int yields_ = 0) : spins(spins_), yields(yields_) {}
+	static WaitStrategy park() {
+		return WaitStrategy(0, 0);
+	}
+	static WaitStrategy spin(unsigned int spins, unsigned int yields = 16) {
+		return WaitStrategy(spins, yields);
+	}
+	//true as soon as ready() does, false once the spin and yield budget is used up.
+	//on a single core nobody can make progress while we spin, so only yield there.
+	template<typename Pred>
+	bool spinUntil(Pred ready) const {
+		static const bool multicore = std::thread::hardware_concurrency() > 1;
+		for (unsigned int i = 0; multicore && i < spins; i++) {
+			if (ready()) {
+				return true;
+			}
+			cpu_relax();
+		}
+		for (unsigned int i = 0; i < yields; i++) {
+			if (ready()) {
+				return true;
+			}
+			std::this_thread::yield();
+		}
+		return ready();
+	}
+	//spin, then park on ev until ready(). Whoever makes ready() true notifies ev.
+	template<typename Pred>
+	void waitUntil(event_count& ev, Pred ready) const {
+		if (spinUntil(ready)) {
+			return;
+		}
+		for (;;) {
+			uint32_t key = ev.prepareWait();
+			if (ready()) {
+				ev.cancelWait();
+				return;
+			}
+			ev.wait(key);
+			if (ready()) {
+				return;
+			}
+		}
+	}
+	unsigned int spins;
+	unsigned int yields;
+};
@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include "design_pattern.h"
+#include "mpsc_queue.h"
+
+//Chase-Lev work stealing deque (Le, Pop, Cohen, Nardelli: "Correct and Efficient
+//Work-Stealing for Weak Memory Models").
+//push/pop are owner only and work on the bottom (LIFO), steal may be called by any thread
+//and takes from the top (FIFO). T must be a pointer type, nullptr means empty.
+template<typename T>
+class work_stealing_deque : public noncopyable {
+public:
+	explicit work_stealing_deque(size_t capacity = 256) : m_top(0), m_bottom(0) {
+		size_t cap = 1;
+		while (cap < capacity) {
+			cap <<= 1;
+		}
+		m_array.store(new Array(cap), std::memory_order_relaxed);
+	}
+	~work_stealing_deque() {
+		delete m_array.load(std::memory_order_relaxed);
+		for (auto it = m_retired.begin(); it != m_retired.end(); ++it) {
+			delete *it;
+		}
+	}
+	void push(T item) {
+		int64_t b = m_bottom.load(std::memory_order_relaxed);
+		int64_t t = m_top.load(std::memory_order_acquire);
+		Array* a = m_array.load(std::memory_order_relaxed);
+		if (b - t > int64_t(a->mask)) {
+			a = grow(a, t, b);
+		}
+		a->put(b, item);
+		m_bottom.store(b + 1, std::memory_order_release);
+	}
+	T pop() {
+		int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+		Array* a = m_array.load(std::memory_order_relaxed);
+		m_bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = m_top.load(std::memory_order_relaxed);
+		if (t > b) {
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		T item = a->get(b);
+		if (t == b) {
+			//last item, race against thieves.
+			if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				item = nullptr;
+			}
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return item;
+	}
+	//nullptr when empty or lost a race with another thief / the owner.
+	T steal() {
+		int64_t t = m_top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = m_bottom.load(std::memory_order_acquire);
+		if (t >= b) {
+			return nullptr;
+		}
+		Array* a = m_array.load(std::memory_order_acquire);
+		T item = a->get(t);
+		if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			return nullptr;
+		}
+		return item;
+	}
+	//approximate, for idle checks.
+	bool empty() const {
+		return m_bottom.load(std::memory_order_acquire) <= m_top.load(std::memory_order_acquire);
+	}
+private:
+	struct Array {
+		explicit Array(size_t cap) : mask(cap - 1), items(new std::atomic<T>[cap]) {}
+		~Array() {
+			delete[] items;
+		}
+		T get(int64_t i) const {
+			return items[i & mask].load(std::memory_order_relaxed);
+		}
+		void put(int64_t i, T item) {
+			items[i & mask].store(item, std::memory_order_relaxed);
+		}
+		size_t mask;
+		std::atomic<T>* items;
+	};
+	Array* grow(Array* a, int64_t t, int64_t b) {
+		Array* n = new Array((a->mask + 1) << 1);
+		for (int64_t i = t; i < b; ++i) {
+			n->put(i, a->get(i));
+		}
+		//thieves may still read the old array, keep it until we die.
+		m_retired.push_back(a);
+		m_array.store(n, std::memory_order_release);
+		return n;
+	}
+	std::atomic<int64_t> m_top;
+	char m_pad0[detail::CACHE_LINE_SIZE - sizeof(std::atomic<int64_t>)];
+	std::atomic<int64_t> m_bottom;
+	std::atomic<Array*> m_array;
+	std::vector<Array*> m_retired;
+};